@@ -2,6 +2,14 @@
 #include <vector>
 #include <cmath>
 #include <limits>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 struct Vec3 { double x,y,z; };
@@ -16,6 +24,30 @@ struct AABB {
     Vec3 min, max;
 };
 
+// Single-precision box used inside BVH nodes
+struct AABBf {
+    float min[3], max[3];
+};
+
+// Allocator that hands out Align-byte aligned storage for node arrays
+template <typename T, size_t Align>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), align_val_t(Align)));
+    }
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, align_val_t(Align));
+    }
+    bool operator==(const AlignedAllocator&) const { return true; }
+    bool operator!=(const AlignedAllocator&) const { return false; }
+};
+
 // Compute AABB of a sphere
 AABB getSphereAABB(const Sphere &s) {
     return {
@@ -24,103 +56,1161 @@ AABB getSphereAABB(const Sphere &s) {
     };
 }
 
-// Ray-AABB intersection
-bool intersectAABB(const Ray &r, const AABB &b) {
-    double tmin = (b.min.x - r.orig.x) / r.dir.x;
-    double tmax = (b.max.x - r.orig.x) / r.dir.x;
-    if (tmin > tmax) swap(tmin, tmax);
-
-    double tymin = (b.min.y - r.orig.y) / r.dir.y;
-    double tymax = (b.max.y - r.orig.y) / r.dir.y;
-    if (tymin > tymax) swap(tymin, tymax);
-
-    if ((tmin > tymax) || (tymin > tmax)) return false;
-
-    if (tymin > tmin) tmin = tymin;
-    if (tymax < tmax) tmax = tymax;
-
-    double tzmin = (b.min.z - r.orig.z) / r.dir.z;
-    double tzmax = (b.max.z - r.orig.z) / r.dir.z;
-    if (tzmin > tzmax) swap(tzmin, tzmax);
-
-    if ((tmin > tzmax) || (tzmin > tmax)) return false;
-
-    return true;
+// Slab test against a node box, clipped to [tmin, tmax]; tEntry receives the entry distance
+bool intersectAABB(const Ray &r, const Vec3 &invDir, const AABBf &b,
+                   double tmin, double tmax, double &tEntry) {
+    double tx0 = (b.min[0] - r.orig.x) * invDir.x, tx1 = (b.max[0] - r.orig.x) * invDir.x;
+    double ty0 = (b.min[1] - r.orig.y) * invDir.y, ty1 = (b.max[1] - r.orig.y) * invDir.y;
+    double tz0 = (b.min[2] - r.orig.z) * invDir.z, tz1 = (b.max[2] - r.orig.z) * invDir.z;
+    tmin = max(tmin, max(min(tx0, tx1), max(min(ty0, ty1), min(tz0, tz1))));
+    tmax = min(tmax, min(max(tx0, tx1), min(max(ty0, ty1), max(tz0, tz1))));
+    tEntry = tmin;
+    return tmin <= tmax;
 }
 
-// Simple ray-sphere intersection
-bool intersectSphere(const Ray &r, const Sphere &s, double &t) {
+// Ray-sphere intersection restricted to the open interval (tmin, tmax)
+bool intersectSphere(const Ray &r, const Sphere &s, double tmin, double tmax, double &t) {
     double ocx = r.orig.x - s.center.x;
     double ocy = r.orig.y - s.center.y;
     double ocz = r.orig.z - s.center.z;
+    double a = r.dir.x*r.dir.x + r.dir.y*r.dir.y + r.dir.z*r.dir.z;
     double b = ocx*r.dir.x + ocy*r.dir.y + ocz*r.dir.z;
     double c = ocx*ocx + ocy*ocy + ocz*ocz - s.radius*s.radius;
-    double disc = b*b - c;
+    double disc = b*b - a*c;
     if (disc < 0) return false;
-    t = -b - sqrt(disc);
-    return t > 0;
+    double sq = sqrt(disc);
+    t = (-b - sq) / a;
+    if (t <= tmin || t >= tmax) {
+        t = (-b + sq) / a;
+        if (t <= tmin || t >= tmax) return false;
+    }
+    return true;
 }
 
-struct BVHNode {
-    AABB box;
-    int left, right;
-    int sphereIndex; // –1 if not leaf
+// 32-byte node, stored depth-first so an inner node's left child is the next node
+struct alignas(32) BVHNode {
+    AABBf box;
+    int offset;      // inner: right child index, leaf: first entry in bvhSphereIndices
+    int sphereCount; // > 0 only for leaves
 };
+static_assert(sizeof(BVHNode) == 32, "BVHNode must stay 32 bytes");
+
+// Build-quality knobs for the SAH builder
+struct BVHBuildParams {
+    int binCount = 16;              // candidate split planes per axis
+    int maxLeafSize = 4;            // spheres allowed in one leaf
+    double traversalCost = 1.0;     // cost of visiting an inner node
+    double intersectionCost = 1.0;  // cost of one ray-sphere test
+};
+
+vector<BVHNode, AlignedAllocator<BVHNode, 64>> bvh;
+vector<int> bvhSphereIndices; // leaves reference ranges of this array
+long long gNodeVisits = 0;
+
+AABB emptyAABB() {
+    const double inf = numeric_limits<double>::infinity();
+    return { {inf, inf, inf}, {-inf, -inf, -inf} };
+}
+
+void growAABB(AABB &b, const AABB &o) {
+    b.min.x = min(b.min.x, o.min.x);
+    b.min.y = min(b.min.y, o.min.y);
+    b.min.z = min(b.min.z, o.min.z);
+    b.max.x = max(b.max.x, o.max.x);
+    b.max.y = max(b.max.y, o.max.y);
+    b.max.z = max(b.max.z, o.max.z);
+}
+
+void growAABB(AABB &b, const Vec3 &p) {
+    growAABB(b, AABB{p, p});
+}
 
-vector<BVHNode> bvh;
+double surfaceArea(const AABB &b) {
+    double dx = b.max.x - b.min.x, dy = b.max.y - b.min.y, dz = b.max.z - b.min.z;
+    if (dx < 0 || dy < 0 || dz < 0) return 0.0;
+    return 2.0 * (dx*dy + dy*dz + dz*dx);
+}
+
+// Round outward so the float box always contains the double one
+AABBf toAABBf(const AABB &b) {
+    const float inf = numeric_limits<float>::infinity();
+    return {
+        { nextafterf(float(b.min.x), -inf), nextafterf(float(b.min.y), -inf), nextafterf(float(b.min.z), -inf) },
+        { nextafterf(float(b.max.x), inf), nextafterf(float(b.max.y), inf), nextafterf(float(b.max.z), inf) }
+    };
+}
+
+double axisOf(const Vec3 &v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
 
-// Build a very simple BVH by splitting in half
-int buildBVH(int start, int end, vector<Sphere>& spheres) {
+// Build a BVH over spheres[bvhSphereIndices[start..end)] with a binned SAH
+int buildBVH(int start, int end, vector<Sphere>& spheres, const BVHBuildParams &params) {
     int nodeIndex = bvh.size();
     bvh.push_back({});
-    BVHNode &node = bvh.back();
-    node.left = node.right = -1;
-    node.sphereIndex = -1;
-
-    // Compute enclosing AABB
-    AABB bb = getSphereAABB(spheres[start]);
-    for(int i = start+1; i < end; i++) {
-        AABB sb = getSphereAABB(spheres[i]);
-        bb.min.x = min(bb.min.x, sb.min.x);
-        bb.min.y = min(bb.min.y, sb.min.y);
-        bb.min.z = min(bb.min.z, sb.min.z);
-        bb.max.x = max(bb.max.x, sb.max.x);
-        bb.max.y = max(bb.max.y, sb.max.y);
-        bb.max.z = max(bb.max.z, sb.max.z);
-    }
-    node.box = bb;
+
+    AABB bb = emptyAABB(), centroidBox = emptyAABB();
+    for (int i = start; i < end; i++) {
+        const Sphere &s = spheres[bvhSphereIndices[i]];
+        growAABB(bb, getSphereAABB(s));
+        growAABB(centroidBox, s.center);
+    }
 
     int count = end - start;
-    if (count == 1) {
-        node.sphereIndex = start;
-    } else {
-        int mid = (start + end) / 2;
-        node.left = buildBVH(start, mid, spheres);
-        node.right = buildBVH(mid, end, spheres);
+    bvh[nodeIndex] = {toAABBf(bb), start, count};
+    if (count == 1) return nodeIndex;
+
+    // Find the cheapest bin boundary over all three axes
+    struct Bin { AABB box; int count; };
+    int binCount = max(2, params.binCount);
+    vector<Bin> bins(binCount);
+    vector<double> rightArea(binCount);
+    vector<int> rightCount(binCount);
+
+    double bestCost = numeric_limits<double>::infinity();
+    int bestAxis = -1, bestSplit = -1;
+    double parentArea = surfaceArea(bb);
+
+    for (int axis = 0; axis < 3; axis++) {
+        double cmin = axisOf(centroidBox.min, axis);
+        double cmax = axisOf(centroidBox.max, axis);
+        if (cmax <= cmin) continue;
+        double scale = binCount / (cmax - cmin);
+
+        for (Bin &b : bins) b = {emptyAABB(), 0};
+        for (int i = start; i < end; i++) {
+            const Sphere &s = spheres[bvhSphereIndices[i]];
+            int b = min(binCount - 1, int((axisOf(s.center, axis) - cmin) * scale));
+            bins[b].count++;
+            growAABB(bins[b].box, getSphereAABB(s));
+        }
+
+        // Sweep right-to-left for right side areas, then left-to-right for cost
+        AABB acc = emptyAABB();
+        int n = 0;
+        for (int b = binCount - 1; b > 0; b--) {
+            growAABB(acc, bins[b].box);
+            n += bins[b].count;
+            rightArea[b] = surfaceArea(acc);
+            rightCount[b] = n;
+        }
+        acc = emptyAABB();
+        n = 0;
+        for (int b = 0; b < binCount - 1; b++) {
+            growAABB(acc, bins[b].box);
+            n += bins[b].count;
+            if (n == 0 || rightCount[b + 1] == 0) continue;
+            double cost = params.traversalCost + params.intersectionCost *
+                (surfaceArea(acc) * n + rightArea[b + 1] * rightCount[b + 1]) / parentArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
     }
+
+    double leafCost = params.intersectionCost * count;
+    if (bestAxis == -1 || (count <= params.maxLeafSize && leafCost <= bestCost))
+        return nodeIndex;
+
+    double cmin = axisOf(centroidBox.min, bestAxis);
+    double scale = binCount / (axisOf(centroidBox.max, bestAxis) - cmin);
+    int *mid = partition(bvhSphereIndices.data() + start, bvhSphereIndices.data() + end,
+        [&](int idx) {
+            int b = min(binCount - 1, int((axisOf(spheres[idx].center, bestAxis) - cmin) * scale));
+            return b <= bestSplit;
+        });
+    int midIndex = mid - bvhSphereIndices.data();
+
+    buildBVH(start, midIndex, spheres, params); // lands at nodeIndex + 1
+    int right = buildBVH(midIndex, end, spheres, params);
+    bvh[nodeIndex].offset = right;
+    bvh[nodeIndex].sphereCount = 0;
     return nodeIndex;
 }
 
-// Traverse BVH for ray intersection
-bool hitBVH(const Ray &r, int nodeIndex, vector<Sphere>& spheres) {
-    BVHNode &node = bvh[nodeIndex];
-    if (!intersectAABB(r, node.box)) return false;
+int buildBVH(vector<Sphere>& spheres, const BVHBuildParams &params = {}) {
+    bvh.clear();
+    bvhSphereIndices.resize(spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++) bvhSphereIndices[i] = i;
+    if (spheres.empty()) return -1;   // a childless node would read as an inner node
+    return buildBVH(0, spheres.size(), spheres, params);
+}
+
+/* ---------------- PARALLEL LBVH BUILDER ---------------- */
+
+// Runs fn(begin, end) over [0, n) split into one contiguous chunk per hardware thread
+template <typename Fn>
+void parallelFor(size_t n, Fn fn) {
+    size_t threads = max(1u, thread::hardware_concurrency());
+    threads = min(threads, max<size_t>(1, n / 4096));
+    vector<thread> pool;
+    for (size_t t = 1; t < threads; t++)
+        pool.emplace_back(fn, n * t / threads, n * (t + 1) / threads);
+    fn(0, n / threads);
+    for (thread &th : pool) th.join();
+}
+
+// Spreads the low 21 bits of v so there are two zero bits between each
+uint64_t expandBits21(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2)  & 0x1249249249249249ULL;
+    return v;
+}
+
+// 63-bit Morton code of a point already normalized to [0, 1]^3
+uint64_t morton63(double x, double y, double z) {
+    const double scale = double(1 << 21) - 1;
+    uint64_t ix = uint64_t(min(max(x, 0.0), 1.0) * scale);
+    uint64_t iy = uint64_t(min(max(y, 0.0), 1.0) * scale);
+    uint64_t iz = uint64_t(min(max(z, 0.0), 1.0) * scale);
+    return expandBits21(ix) << 2 | expandBits21(iy) << 1 | expandBits21(iz);
+}
+
+// Parallel LSD radix sort of (key, value) pairs, 11 bits per pass
+void radixSortPairs(vector<uint64_t> &keys, vector<int> &values, int keyBits) {
+    const int DIGIT_BITS = 11, BUCKETS = 1 << DIGIT_BITS;
+    size_t n = keys.size();
+    size_t threads = max(1u, thread::hardware_concurrency());
+    threads = min(threads, max<size_t>(1, n / 4096));
 
-    if (node.sphereIndex != -1) {
-        double t;
-        return intersectSphere(r, spheres[node.sphereIndex], t);
+    vector<uint64_t> keysTmp(n);
+    vector<int> valuesTmp(n);
+    vector<size_t> counts(threads * BUCKETS);
+
+    for (int shift = 0; shift < keyBits; shift += DIGIT_BITS) {
+        fill(counts.begin(), counts.end(), 0);
+        auto histogram = [&](size_t t) {
+            size_t *c = &counts[t * BUCKETS];
+            for (size_t i = n * t / threads; i < n * (t + 1) / threads; i++)
+                c[(keys[i] >> shift) & (BUCKETS - 1)]++;
+        };
+        auto scatter = [&](size_t t) {
+            size_t *c = &counts[t * BUCKETS];
+            for (size_t i = n * t / threads; i < n * (t + 1) / threads; i++) {
+                size_t dst = c[(keys[i] >> shift) & (BUCKETS - 1)]++;
+                keysTmp[dst] = keys[i];
+                valuesTmp[dst] = values[i];
+            }
+        };
+
+        vector<thread> pool;
+        for (size_t t = 1; t < threads; t++) pool.emplace_back(histogram, t);
+        histogram(0);
+        for (thread &th : pool) th.join();
+
+        // Exclusive prefix over (digit, thread) keeps the sort stable
+        size_t sum = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            for (size_t t = 0; t < threads; t++) {
+                size_t c = counts[t * BUCKETS + b];
+                counts[t * BUCKETS + b] = sum;
+                sum += c;
+            }
+        }
+
+        pool.clear();
+        for (size_t t = 1; t < threads; t++) pool.emplace_back(scatter, t);
+        scatter(0);
+        for (thread &th : pool) th.join();
+
+        keys.swap(keysTmp);
+        values.swap(valuesTmp);
+    }
+}
+
+// Length of the common key prefix of sorted entries i and j; equal keys fall back to the index
+int commonPrefix(const vector<uint64_t> &codes, int i, int j) {
+    if (j < 0 || j >= (int)codes.size()) return -1;
+    uint64_t a = codes[i], b = codes[j];
+    if (a == b) return 64 + __builtin_clz(uint32_t(i ^ j));
+    return __builtin_clzll(a ^ b);
+}
+
+// Builds bvh with the Karras linear BVH method: Morton codes, radix sort, then every
+// internal node is emitted independently from the sorted codes.
+// Produces one sphere per leaf, flattened to the usual depth-first layout.
+int buildLBVH(const vector<Sphere>& spheres) {
+    int n = spheres.size();
+    bvh.clear();
+    bvhSphereIndices.resize(n);
+    if (n == 0) return -1;
+    if (n == 1) {
+        bvhSphereIndices[0] = 0;
+        bvh.push_back({toAABBf(getSphereAABB(spheres[0])), 0, 1});
+        return 0;
+    }
+
+    // Centroid bounds and Morton codes
+    AABB centroidBox = emptyAABB();
+    for (const Sphere &s : spheres) growAABB(centroidBox, s.center);
+    Vec3 extent = {
+        max(centroidBox.max.x - centroidBox.min.x, 1e-30),
+        max(centroidBox.max.y - centroidBox.min.y, 1e-30),
+        max(centroidBox.max.z - centroidBox.min.z, 1e-30)
+    };
+    vector<uint64_t> codes(n);
+    parallelFor(n, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const Vec3 &c = spheres[i].center;
+            codes[i] = morton63((c.x - centroidBox.min.x) / extent.x,
+                                (c.y - centroidBox.min.y) / extent.y,
+                                (c.z - centroidBox.min.z) / extent.z);
+            bvhSphereIndices[i] = i;
+        }
+    });
+    radixSortPairs(codes, bvhSphereIndices, 63);
+
+    // Internal node i has children childA/childB; values >= n - 1 mean leaf (value - (n - 1))
+    int internal = n - 1;
+    vector<int> childA(internal), childB(internal), parent(internal + n, -1);
+    parallelFor(internal, [&](size_t begin, size_t end) {
+        for (int i = begin; i < (int)end; i++) {
+            int d = commonPrefix(codes, i, i + 1) - commonPrefix(codes, i, i - 1) >= 0 ? 1 : -1;
+            int deltaMin = commonPrefix(codes, i, i - d);
+
+            int lmax = 2;
+            while (commonPrefix(codes, i, i + lmax * d) > deltaMin) lmax *= 2;
+            int l = 0;
+            for (int t = lmax / 2; t >= 1; t /= 2)
+                if (commonPrefix(codes, i, i + (l + t) * d) > deltaMin) l += t;
+            int j = i + l * d;
+
+            int deltaNode = commonPrefix(codes, i, j);
+            int s = 0;
+            for (int t = (l + 1) / 2; ; t = (t + 1) / 2) {
+                if (commonPrefix(codes, i, i + (s + t) * d) > deltaNode) s += t;
+                if (t == 1) break;
+            }
+            int gamma = i + s * d + min(d, 0);
+
+            childA[i] = (min(i, j) == gamma) ? internal + gamma : gamma;
+            childB[i] = (max(i, j) == gamma + 1) ? internal + gamma + 1 : gamma + 1;
+            parent[childA[i]] = i;
+            parent[childB[i]] = i;
+        }
+    });
+
+    // Bounds and subtree sizes bottom-up; the second child to arrive finishes the parent
+    vector<AABB> bounds(internal + n);
+    vector<int> subtreeSize(internal + n, 1);
+    vector<atomic<int>> arrivals(internal);
+    for (atomic<int> &a : arrivals) a.store(0);
+    parallelFor(n, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            int node = internal + i;
+            bounds[node] = getSphereAABB(spheres[bvhSphereIndices[i]]);
+            int p = parent[node];
+            while (p >= 0 && arrivals[p].fetch_add(1, memory_order_acq_rel) == 1) {
+                bounds[p] = bounds[childA[p]];
+                growAABB(bounds[p], bounds[childB[p]]);
+                subtreeSize[p] = 1 + subtreeSize[childA[p]] + subtreeSize[childB[p]];
+                p = parent[p];
+            }
+        }
+    });
+
+    // Depth-first flattening: a node at position pos puts its left child at pos + 1 and its
+    // right child after the whole left subtree, so disjoint subtrees can be written in parallel
+    bvh.resize(internal + n);
+    auto emit = [&](int root, int rootPos) {
+        vector<pair<int, int>> stack = {{root, rootPos}};
+        while (!stack.empty()) {
+            auto [node, pos] = stack.back();
+            stack.pop_back();
+            if (node >= internal) {
+                bvh[pos] = {toAABBf(bounds[node]), node - internal, 1};
+                continue;
+            }
+            int rightPos = pos + 1 + subtreeSize[childA[node]];
+            bvh[pos] = {toAABBf(bounds[node]), rightPos, 0};
+            stack.push_back({childB[node], rightPos});
+            stack.push_back({childA[node], pos + 1});
+        }
+    };
+
+    // Split the top of the tree into independent subtrees, then emit those in parallel
+    vector<pair<int, int>> frontier = {{0, 0}}, subtrees;
+    size_t target = 4 * max(1u, thread::hardware_concurrency());
+    while (!frontier.empty() && frontier.size() + subtrees.size() < target) {
+        vector<pair<int, int>> next;
+        for (auto [node, pos] : frontier) {
+            if (node >= internal || subtreeSize[node] < 4096) {
+                subtrees.push_back({node, pos});
+                continue;
+            }
+            int rightPos = pos + 1 + subtreeSize[childA[node]];
+            bvh[pos] = {toAABBf(bounds[node]), rightPos, 0};
+            next.push_back({childA[node], pos + 1});
+            next.push_back({childB[node], rightPos});
+        }
+        frontier.swap(next);
     }
-    return hitBVH(r, node.left, spheres) || hitBVH(r, node.right, spheres);
+    subtrees.insert(subtrees.end(), frontier.begin(), frontier.end());
+
+    atomic<size_t> nextSubtree(0);
+    auto worker = [&]() {
+        for (size_t k; (k = nextSubtree.fetch_add(1)) < subtrees.size(); )
+            emit(subtrees[k].first, subtrees[k].second);
+    };
+    vector<thread> pool;
+    for (size_t t = 1; t < min<size_t>(subtrees.size(), thread::hardware_concurrency()); t++)
+        pool.emplace_back(worker);
+    worker();
+    for (thread &th : pool) th.join();
+    return 0;
 }
 
+/* ---------------- BVH REFIT ---------------- */
+
+// Per-build data needed to refit the current bvh in place
+struct BVHRefitState {
+    vector<vector<int>> levels; // node indices grouped by depth
+    double buildCost;           // SAH cost right after the last full build
+    BVHBuildParams params;      // settings the tree was built with, reused on rebuild
+};
+
+AABB toAABB(const AABBf &b) {
+    return { {b.min[0], b.min[1], b.min[2]}, {b.max[0], b.max[1], b.max[2]} };
+}
+
+// SAH cost of the whole tree, normalized by the root surface area
+double bvhSAHCost(const BVHBuildParams &params = {}) {
+    if (bvh.empty()) return 0.0;
+    double rootArea = surfaceArea(toAABB(bvh[0].box));
+    if (rootArea <= 0.0) return 0.0;
+    double cost = 0.0;
+    for (const BVHNode &n : bvh) {
+        double area = surfaceArea(toAABB(n.box));
+        cost += n.sphereCount > 0 ? area * n.sphereCount * params.intersectionCost
+                                  : area * params.traversalCost;
+    }
+    return cost / rootArea;
+}
+
+// Call after buildBVH or buildLBVH to enable refitting; pass the params the tree was built with
+BVHRefitState prepareBVHRefit(const BVHBuildParams &params = {}) {
+    BVHRefitState state;
+    state.params = params;
+    state.buildCost = bvhSAHCost(params);
+    vector<pair<int, int>> stack;
+    if (!bvh.empty()) stack.push_back({0, 0});
+    while (!stack.empty()) {
+        auto [node, depth] = stack.back();
+        stack.pop_back();
+        if ((int)state.levels.size() <= depth) state.levels.resize(depth + 1);
+        state.levels[depth].push_back(node);
+        if (bvh[node].sphereCount == 0) {
+            stack.push_back({node + 1, depth + 1});
+            stack.push_back({bvh[node].offset, depth + 1});
+        }
+    }
+    return state;
+}
+
+// Recomputes every node box bottom-up after spheres moved, one parallel pass per level.
+// Topology is unchanged. Returns the SAH cost relative to the last full build.
+// A collapsed bvh4 is not updated and must be rebuilt with buildBVH4.
+double refitBVH(const vector<Sphere>& spheres, const BVHRefitState &state) {
+    for (int depth = (int)state.levels.size() - 1; depth >= 0; depth--) {
+        const vector<int> &level = state.levels[depth];
+        parallelFor(level.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                BVHNode &n = bvh[level[i]];
+                AABB b = emptyAABB();
+                if (n.sphereCount > 0) {
+                    for (int k = n.offset; k < n.offset + n.sphereCount; k++)
+                        growAABB(b, getSphereAABB(spheres[bvhSphereIndices[k]]));
+                    n.box = toAABBf(b);
+                } else {
+                    const AABBf &l = bvh[level[i] + 1].box, &r = bvh[n.offset].box;
+                    for (int a = 0; a < 3; a++) {
+                        n.box.min[a] = min(l.min[a], r.min[a]);
+                        n.box.max[a] = max(l.max[a], r.max[a]);
+                    }
+                }
+            }
+        });
+    }
+    double cost = bvhSAHCost(state.params);
+    // A build with no measurable cost (empty or zero-size scene) can only have grown
+    if (state.buildCost <= 0.0) return cost > 0.0 ? numeric_limits<double>::infinity() : 1.0;
+    return cost / state.buildCost;
+}
+
+// Refits, and falls back to a full SAH rebuild once cost growth exceeds maxCostGrowth.
+// Returns true when the tree was rebuilt.
+bool refitOrRebuildBVH(vector<Sphere>& spheres, BVHRefitState &state,
+                       double maxCostGrowth, double &costGrowth) {
+    costGrowth = refitBVH(spheres, state);
+    if (costGrowth <= maxCostGrowth) return false;
+    buildBVH(spheres, state.params);
+    state = prepareBVHRefit(state.params);
+    return true;
+}
+
+struct SphereHit {
+    double t;
+    int sphereIndex;
+    Vec3 normal;
+};
+
+const int BVH_STACK_SIZE = 128;
+
+// Storage for a traversal stack: fixed for ordinary trees, moved to the heap when a deep
+// tree (degenerate input, long LBVH chains) would overrun it. Callers keep the top in
+// locals and check room() before pushing, so the hot loop stays in registers.
+template <typename T, int N = BVH_STACK_SIZE>
+struct TraversalStack {
+    T fixed[N];
+    vector<T> spill;
+    T *data = fixed;
+    int capacity = N;
+
+    // Returns the storage after making room for `extra` entries above `size`
+    T *room(int size, int extra) {
+        if (size + extra <= capacity) return data;
+        while (capacity < size + extra) capacity *= 2;
+        vector<T> bigger(capacity);
+        copy(data, data + size, bigger.begin());
+        spill.swap(bigger);
+        return data = spill.data();
+    }
+};
+
+Vec3 inverseDir(const Vec3 &d) {
+    return {1.0 / d.x, 1.0 / d.y, 1.0 / d.z};
+}
+
+// Nearest sphere in (tmin, tmax) below startNode, whose box the caller has already tested.
+// Shrinks tmax to the hit distance and returns the sphere index, or -1.
+int closestHitFrom(const Ray &r, const Vec3 &invDir, const vector<Sphere>& spheres,
+                   int startNode, double tmin, double &tmax) {
+    struct Entry { int node; double t; };
+    TraversalStack<Entry> storage;
+    Entry *stack = storage.data;
+    int stackSize = 0;
+    stack[stackSize++] = {startNode, tmin};
+    int hitIndex = -1;
+
+    while (stackSize > 0) {
+        Entry e = stack[--stackSize];
+        if (e.t >= tmax) continue;
+        gNodeVisits++;
+        const BVHNode &node = bvh[e.node];
+
+        if (node.sphereCount > 0) {
+            for (int i = node.offset; i < node.offset + node.sphereCount; i++) {
+                double t;
+                if (intersectSphere(r, spheres[bvhSphereIndices[i]], tmin, tmax, t)) {
+                    tmax = t;
+                    hitIndex = bvhSphereIndices[i];
+                }
+            }
+            continue;
+        }
+
+        int left = e.node + 1, right = node.offset;
+        double tl, tr;
+        bool hitL = intersectAABB(r, invDir, bvh[left].box, tmin, tmax, tl);
+        bool hitR = intersectAABB(r, invDir, bvh[right].box, tmin, tmax, tr);
+        stack = storage.room(stackSize, 2);
+        if (hitL && hitR) {
+            if (tl > tr) { swap(left, right); swap(tl, tr); }
+            stack[stackSize++] = {right, tr};
+            stack[stackSize++] = {left, tl};
+        } else if (hitL) {
+            stack[stackSize++] = {left, tl};
+        } else if (hitR) {
+            stack[stackSize++] = {right, tr};
+        }
+    }
+    return hitIndex;
+}
+
+Vec3 sphereNormal(const Ray &r, const Sphere &s, double t) {
+    return {
+        (r.orig.x + r.dir.x * t - s.center.x) / s.radius,
+        (r.orig.y + r.dir.y * t - s.center.y) / s.radius,
+        (r.orig.z + r.dir.z * t - s.center.z) / s.radius
+    };
+}
+
+// Closest-hit query: nearest sphere in (tmin, tmax), visiting the nearer child first
+bool closestHitBVH(const Ray &r, const vector<Sphere>& spheres,
+                   double tmin, double tmax, SphereHit &hit) {
+    Vec3 invDir = inverseDir(r.dir);
+    double tEntry;
+    if (bvh.empty() || !intersectAABB(r, invDir, bvh[0].box, tmin, tmax, tEntry)) return false;
+
+    hit.sphereIndex = closestHitFrom(r, invDir, spheres, 0, tmin, tmax);
+    if (hit.sphereIndex < 0) return false;
+    hit.t = tmax;
+    hit.normal = sphereNormal(r, spheres[hit.sphereIndex], tmax);
+    return true;
+}
+
+// Any-hit (occlusion) query for shadow rays: stops at the first sphere in (tmin, tmax)
+bool anyHitBVH(const Ray &r, const vector<Sphere>& spheres, double tmin, double tmax) {
+    Vec3 invDir = inverseDir(r.dir);
+    double tEntry;
+    if (bvh.empty() || !intersectAABB(r, invDir, bvh[0].box, tmin, tmax, tEntry)) return false;
+
+    TraversalStack<int> storage;
+    int *stack = storage.data;
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        gNodeVisits++;
+        const BVHNode &node = bvh[stack[--stackSize]];
+
+        if (node.sphereCount > 0) {
+            double t;
+            for (int i = node.offset; i < node.offset + node.sphereCount; i++)
+                if (intersectSphere(r, spheres[bvhSphereIndices[i]], tmin, tmax, t)) return true;
+            continue;
+        }
+
+        int left = &node - bvh.data() + 1, right = node.offset;
+        stack = storage.room(stackSize, 2);
+        if (intersectAABB(r, invDir, bvh[right].box, tmin, tmax, tEntry)) stack[stackSize++] = right;
+        if (intersectAABB(r, invDir, bvh[left].box, tmin, tmax, tEntry)) stack[stackSize++] = left;
+    }
+    return false;
+}
+
+/* ---------------- 4-WIDE BVH ---------------- */
+
+// Four children per node with their bounds stored per component (SoA) for one SIMD box test
+struct alignas(64) BVH4Node {
+    float minX[4], minY[4], minZ[4];
+    float maxX[4], maxY[4], maxZ[4];
+    int child[4];   // inner: BVH4 node index, leaf: first entry in bvhSphereIndices, -1 if empty
+    int count[4];   // spheres in a leaf child, 0 for inner children
+};
+
+vector<BVH4Node, AlignedAllocator<BVH4Node, 64>> bvh4;
+
+// Collapse the binary subtree at nodeIndex, pulling up grandchildren until four slots fill
+int collapseBVH4(int nodeIndex) {
+    int slots[4] = { nodeIndex + 1, bvh[nodeIndex].offset, -1, -1 };
+    int used = 2;
+    while (used < 4) {
+        int best = -1;
+        double bestArea = -1.0;
+        for (int i = 0; i < used; i++) {
+            const BVHNode &n = bvh[slots[i]];
+            if (n.sphereCount > 0) continue;
+            AABB b = { {n.box.min[0], n.box.min[1], n.box.min[2]}, {n.box.max[0], n.box.max[1], n.box.max[2]} };
+            double area = surfaceArea(b);
+            if (area > bestArea) { bestArea = area; best = i; }
+        }
+        if (best < 0) break;
+        int expanded = slots[best];
+        slots[best] = expanded + 1;
+        slots[used++] = bvh[expanded].offset;
+    }
+
+    int wideIndex = bvh4.size();
+    bvh4.push_back({});
+    for (int i = 0; i < 4; i++) {
+        BVH4Node &w = bvh4[wideIndex];
+        if (i >= used) {
+            w.minX[i] = w.minY[i] = w.minZ[i] = numeric_limits<float>::infinity();
+            w.maxX[i] = w.maxY[i] = w.maxZ[i] = -numeric_limits<float>::infinity();
+            w.child[i] = -1;
+            w.count[i] = 0;
+            continue;
+        }
+        const BVHNode &n = bvh[slots[i]];
+        w.minX[i] = n.box.min[0]; w.minY[i] = n.box.min[1]; w.minZ[i] = n.box.min[2];
+        w.maxX[i] = n.box.max[0]; w.maxY[i] = n.box.max[1]; w.maxZ[i] = n.box.max[2];
+        if (n.sphereCount > 0) {
+            w.child[i] = n.offset;
+            w.count[i] = n.sphereCount;
+        } else {
+            int c = collapseBVH4(slots[i]);
+            bvh4[wideIndex].child[i] = c;
+            bvh4[wideIndex].count[i] = 0;
+        }
+    }
+    return wideIndex;
+}
+
+// Builds bvh4 from the binary bvh; a single-leaf tree has no wide form
+void buildBVH4() {
+    bvh4.clear();
+    if (bvh.size() > 1) collapseBVH4(0);
+}
+
+// Entry distance of each child box, +inf for children the ray misses inside [tmin, tmax]
+void intersectChildren4(const BVH4Node &n, const Ray &r, const Vec3 &invDir,
+                        float tmin, float tmax, float tNear[4]) {
+#if defined(__SSE2__)
+    __m128 ox = _mm_set1_ps(r.orig.x), oy = _mm_set1_ps(r.orig.y), oz = _mm_set1_ps(r.orig.z);
+    __m128 ix = _mm_set1_ps(invDir.x), iy = _mm_set1_ps(invDir.y), iz = _mm_set1_ps(invDir.z);
+    __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.minX), ox), ix);
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.maxX), ox), ix);
+    __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.minY), oy), iy);
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.maxY), oy), iy);
+    __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.minZ), oz), iz);
+    __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.maxZ), oz), iz);
+    __m128 tn = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                           _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_set1_ps(tmin)));
+    __m128 tf = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                           _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(tmax)));
+    __m128 miss = _mm_cmpgt_ps(tn, tf);
+    __m128 inf = _mm_set1_ps(numeric_limits<float>::infinity());
+    _mm_storeu_ps(tNear, _mm_or_ps(_mm_and_ps(miss, inf), _mm_andnot_ps(miss, tn)));
+#else
+    for (int i = 0; i < 4; i++) {
+        AABBf b = { {n.minX[i], n.minY[i], n.minZ[i]}, {n.maxX[i], n.maxY[i], n.maxZ[i]} };
+        double tEntry;
+        tNear[i] = intersectAABB(r, invDir, b, tmin, tmax, tEntry) ? float(tEntry)
+                                                                   : numeric_limits<float>::infinity();
+    }
+#endif
+}
+
+// Closest-hit query on the 4-wide BVH; children are visited in entry-distance order
+bool closestHitBVH4(const Ray &r, const vector<Sphere>& spheres,
+                    double tmin, double tmax, SphereHit &hit) {
+    if (bvh4.empty()) return closestHitBVH(r, spheres, tmin, tmax, hit);
+
+    Vec3 invDir = inverseDir(r.dir);
+    struct Entry { int child, count; float t; };
+    TraversalStack<Entry, BVH_STACK_SIZE * 3> storage;
+    Entry *stack = storage.data;
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, float(tmin)};
+    hit.sphereIndex = -1;
+
+    while (stackSize > 0) {
+        Entry e = stack[--stackSize];
+        if (e.t >= tmax) continue;
+
+        if (e.count > 0) {
+            for (int i = e.child; i < e.child + e.count; i++) {
+                double t;
+                if (intersectSphere(r, spheres[bvhSphereIndices[i]], tmin, tmax, t)) {
+                    tmax = t;
+                    hit.sphereIndex = bvhSphereIndices[i];
+                }
+            }
+            continue;
+        }
+
+        gNodeVisits++;
+        const BVH4Node &n = bvh4[e.child];
+        float tNear[4];
+        intersectChildren4(n, r, invDir, tmin, tmax, tNear);
+
+        // Insertion-sort the hit children far to near so the nearest is popped first
+        Entry order[4];
+        int hits = 0;
+        for (int i = 0; i < 4; i++) {
+            if (n.child[i] < 0 || tNear[i] == numeric_limits<float>::infinity()) continue;
+            Entry c = {n.child[i], n.count[i], tNear[i]};
+            int j = hits++;
+            while (j > 0 && order[j - 1].t < c.t) { order[j] = order[j - 1]; j--; }
+            order[j] = c;
+        }
+        stack = storage.room(stackSize, hits);
+        for (int i = 0; i < hits; i++) stack[stackSize++] = order[i];
+    }
+
+    if (hit.sphereIndex < 0) return false;
+    hit.t = tmax;
+    hit.normal = sphereNormal(r, spheres[hit.sphereIndex], tmax);
+    return true;
+}
+
+// Any-hit (occlusion) query on the 4-wide BVH
+bool anyHitBVH4(const Ray &r, const vector<Sphere>& spheres, double tmin, double tmax) {
+    if (bvh4.empty()) return anyHitBVH(r, spheres, tmin, tmax);
+
+    Vec3 invDir = inverseDir(r.dir);
+    TraversalStack<int, BVH_STACK_SIZE * 3> storage;
+    int *stack = storage.data;
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        gNodeVisits++;
+        const BVH4Node &n = bvh4[stack[--stackSize]];
+        float tNear[4];
+        intersectChildren4(n, r, invDir, tmin, tmax, tNear);
+        stack = storage.room(stackSize, 4);
+
+        for (int i = 0; i < 4; i++) {
+            if (n.child[i] < 0 || tNear[i] == numeric_limits<float>::infinity()) continue;
+            if (n.count[i] == 0) {
+                stack[stackSize++] = n.child[i];
+                continue;
+            }
+            double t;
+            for (int j = n.child[i]; j < n.child[i] + n.count[i]; j++)
+                if (intersectSphere(r, spheres[bvhSphereIndices[j]], tmin, tmax, t)) return true;
+        }
+    }
+    return false;
+}
+
+/* ---------------- 2x2 RAY PACKETS ---------------- */
+
+#if defined(__SSE2__)
+
+// Lane mask as a float vector: all-ones in lanes whose bit is set
+static inline __m128 laneMask4(int mask) {
+    __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask), bits), bits));
+}
+
+static inline __m128 select4(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 abs4(__m128 v) {
+    return _mm_and_ps(v, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+}
+
+// Relative widening applied to float packet intervals; far above float rounding error
+const float PACKET_SLACK = 1e-5f;
+
+struct RayPacket4 {
+    __m128 ox, oy, oz;
+    __m128 dx, dy, dz;
+    __m128 ix, iy, iz;
+    __m128 invA;   // 1 / dot(d, d) per lane
+};
+
+// Bitmask of lanes whose ray may overlap the box inside [tmin, tmax]. The slab interval
+// is widened by a few float ulps so the packet never culls a box that the double-precision
+// single-ray test would enter.
+static inline int packetBoxMask(const RayPacket4 &p, const AABBf &b, __m128 tmin, __m128 tmax) {
+    __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.min[0]), p.ox), p.ix);
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.max[0]), p.ox), p.ix);
+    __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.min[1]), p.oy), p.iy);
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.max[1]), p.oy), p.iy);
+    __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.min[2]), p.oz), p.iz);
+    __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.max[2]), p.oz), p.iz);
+    __m128 tn = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                           _mm_max_ps(_mm_min_ps(tz0, tz1), tmin));
+    __m128 tf = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                           _mm_min_ps(_mm_max_ps(tz0, tz1), tmax));
+    tn = _mm_sub_ps(tn, _mm_mul_ps(abs4(tn), _mm_set1_ps(PACKET_SLACK)));
+    tf = _mm_add_ps(tf, _mm_mul_ps(abs4(tf), _mm_set1_ps(PACKET_SLACK)));
+    return _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+}
+
+// Smallest float not below x, so a float tmax never culls what the double tmax keeps
+static inline float floatAbove(double x) {
+    float f = float(x);
+    return f < x ? nextafterf(f, numeric_limits<float>::infinity()) : f;
+}
+
+// Closest hit for four coherent rays (a 2x2 pixel block) walking the BVH together.
+// Float SIMD only filters: boxes and spheres are tested conservatively, every candidate
+// sphere is settled per lane with the double-precision intersectSphere, and a subtree
+// reached by a single active ray is finished with the scalar traversal. The hits are
+// therefore exactly those of closestHitBVH.
+void closestHitPacket4(const Ray rays[4], const vector<Sphere>& spheres,
+                       double tmin, double tmax, SphereHit hits[4]) {
+    RayPacket4 p;
+    p.ox = _mm_setr_ps(rays[0].orig.x, rays[1].orig.x, rays[2].orig.x, rays[3].orig.x);
+    p.oy = _mm_setr_ps(rays[0].orig.y, rays[1].orig.y, rays[2].orig.y, rays[3].orig.y);
+    p.oz = _mm_setr_ps(rays[0].orig.z, rays[1].orig.z, rays[2].orig.z, rays[3].orig.z);
+    p.dx = _mm_setr_ps(rays[0].dir.x, rays[1].dir.x, rays[2].dir.x, rays[3].dir.x);
+    p.dy = _mm_setr_ps(rays[0].dir.y, rays[1].dir.y, rays[2].dir.y, rays[3].dir.y);
+    p.dz = _mm_setr_ps(rays[0].dir.z, rays[1].dir.z, rays[2].dir.z, rays[3].dir.z);
+    __m128 one = _mm_set1_ps(1.0f);
+    p.ix = _mm_div_ps(one, p.dx);
+    p.iy = _mm_div_ps(one, p.dy);
+    p.iz = _mm_div_ps(one, p.dz);
+    p.invA = _mm_div_ps(one, _mm_add_ps(_mm_add_ps(_mm_mul_ps(p.dx, p.dx), _mm_mul_ps(p.dy, p.dy)),
+                                        _mm_mul_ps(p.dz, p.dz)));
+
+    // Per-lane nearest hit so far, kept in double; vtmax mirrors it rounded up
+    double laneT[4] = { tmax, tmax, tmax, tmax };
+    int laneIdx[4] = { -1, -1, -1, -1 };
+    __m128 vtmin = _mm_set1_ps(tmin);
+    __m128 vtmax = _mm_set1_ps(floatAbove(tmax));
+    __m128 slack = _mm_set1_ps(PACKET_SLACK);
+
+    TraversalStack<int> storage;
+    int *stack = storage.data;
+    int stackSize = 0;
+    if (!bvh.empty()) stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        int nodeIndex = stack[--stackSize];
+        gNodeVisits++;
+        const BVHNode &node = bvh[nodeIndex];
+        int mask = packetBoxMask(p, node.box, vtmin, vtmax);
+        if (mask == 0) continue;
+
+        if (node.sphereCount > 0) {
+            __m128 active = laneMask4(mask);
+            bool improved = false;
+            for (int i = node.offset; i < node.offset + node.sphereCount; i++) {
+                int si = bvhSphereIndices[i];
+                const Sphere &s = spheres[si];
+                __m128 ocx = _mm_sub_ps(p.ox, _mm_set1_ps(s.center.x));
+                __m128 ocy = _mm_sub_ps(p.oy, _mm_set1_ps(s.center.y));
+                __m128 ocz = _mm_sub_ps(p.oz, _mm_set1_ps(s.center.z));
+                // Distance to the chord midpoint and squared half-chord, which keeps float
+                // precision for small spheres far from the origin
+                __m128 tc = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(),
+                    _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, p.dx), _mm_mul_ps(ocy, p.dy)), _mm_mul_ps(ocz, p.dz))), p.invA);
+                __m128 px = _mm_add_ps(ocx, _mm_mul_ps(p.dx, tc));
+                __m128 py = _mm_add_ps(ocy, _mm_mul_ps(p.dy, tc));
+                __m128 pz = _mm_add_ps(ocz, _mm_mul_ps(p.dz, tc));
+                __m128 r2 = _mm_set1_ps(s.radius * s.radius);
+                __m128 h = _mm_sub_ps(r2, _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz)));
+                // Float rounding of h grows with |oc|^2, so the grazing margin does too; the
+                // widened half-chord then bounds both roots
+                __m128 occ = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz));
+                h = _mm_add_ps(h, _mm_mul_ps(_mm_add_ps(r2, occ), slack));
+                __m128 dt = _mm_sqrt_ps(_mm_mul_ps(_mm_max_ps(h, _mm_setzero_ps()), p.invA));
+                __m128 t0 = _mm_sub_ps(tc, dt);
+                __m128 t1 = _mm_add_ps(tc, dt);
+
+                // Candidate lanes, settled below by the exact test
+                __m128 maybe = _mm_and_ps(active, _mm_cmpge_ps(h, _mm_setzero_ps()));
+                maybe = _mm_and_ps(maybe, _mm_cmpge_ps(_mm_add_ps(t1, _mm_mul_ps(abs4(t1), slack)), vtmin));
+                maybe = _mm_and_ps(maybe, _mm_cmple_ps(_mm_sub_ps(t0, _mm_mul_ps(abs4(t0), slack)), vtmax));
+                for (int bits = _mm_movemask_ps(maybe); bits; bits &= bits - 1) {
+                    int lane = __builtin_ctz(bits);
+                    double t;
+                    if (intersectSphere(rays[lane], s, tmin, laneT[lane], t)) {
+                        laneT[lane] = t;
+                        laneIdx[lane] = si;
+                        improved = true;
+                    }
+                }
+                if (improved) {
+                    vtmax = _mm_setr_ps(floatAbove(laneT[0]), floatAbove(laneT[1]),
+                                        floatAbove(laneT[2]), floatAbove(laneT[3]));
+                    improved = false;
+                }
+            }
+            continue;
+        }
+
+        if ((mask & (mask - 1)) == 0) {
+            // Packet has diverged to one ray: finish this subtree with a single-ray walk
+            int lane = __builtin_ctz(mask);
+            int si = closestHitFrom(rays[lane], inverseDir(rays[lane].dir), spheres, nodeIndex, tmin, laneT[lane]);
+            if (si >= 0) {
+                laneIdx[lane] = si;
+                vtmax = _mm_setr_ps(floatAbove(laneT[0]), floatAbove(laneT[1]),
+                                    floatAbove(laneT[2]), floatAbove(laneT[3]));
+            }
+            continue;
+        }
+
+        // Visit the child nearer along the packet's leading direction first
+        int left = nodeIndex + 1, right = node.offset;
+        const AABBf &bl = bvh[left].box, &br = bvh[right].box;
+        double d = (br.min[0] + br.max[0] - bl.min[0] - bl.max[0]) * rays[0].dir.x
+                 + (br.min[1] + br.max[1] - bl.min[1] - bl.max[1]) * rays[0].dir.y
+                 + (br.min[2] + br.max[2] - bl.min[2] - bl.max[2]) * rays[0].dir.z;
+        if (d < 0) swap(left, right);
+        stack = storage.room(stackSize, 2);
+        stack[stackSize++] = right;
+        stack[stackSize++] = left;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        hits[i].sphereIndex = laneIdx[i];
+        if (laneIdx[i] < 0) continue;
+        hits[i].t = laneT[i];
+        hits[i].normal = sphereNormal(rays[i], spheres[laneIdx[i]], laneT[i]);
+    }
+}
+
+#else
+
+// Scalar fallback when SSE is unavailable
+void closestHitPacket4(const Ray rays[4], const vector<Sphere>& spheres,
+                       double tmin, double tmax, SphereHit hits[4]) {
+    for (int i = 0; i < 4; i++)
+        if (!closestHitBVH(rays[i], spheres, tmin, tmax, hits[i])) hits[i].sphereIndex = -1;
+}
+
+#endif
+
 int main() {
     vector<Sphere> spheres = { {{0,0,-5},1.0}, {{2,1,-7},1.2}, {{-1,-1,-4},0.8} };
-    int root = buildBVH(0, spheres.size(), spheres);
+    buildBVH(spheres);
 
     Ray r = {{0,0,0},{0,0,-1}};
 
-    bool hit = hitBVH(r, root, spheres);
-    cout << (hit ? "Ray hit something\n" : "Ray missed all\n");
+    SphereHit hit;
+    if (closestHitBVH(r, spheres, 0.0, numeric_limits<double>::infinity(), hit))
+        cout << "Ray hit sphere " << hit.sphereIndex << " at t = " << hit.t << "\n";
+    else
+        cout << "Ray missed all\n";
+
+    // Particle cloud: report traversal cost of a small frame
+    vector<Sphere> cloud;
+    unsigned seed = 12345;
+    auto rnd = [&]() { seed = seed * 1664525u + 1013904223u; return (seed >> 8) / 16777216.0; };
+    for (int i = 0; i < 100000; i++)
+        cloud.push_back({{rnd()*20 - 10, rnd()*20 - 10, -10 - rnd()*20}, 0.02 + rnd()*0.05});
+
+    buildBVH(cloud);
+    const int W = 128, H = 128;
+    const double inf = numeric_limits<double>::infinity();
+    Vec3 lightPos = {5, 10, 0};
+    int hits = 0, shadowed = 0;
+    long long primaryVisits = 0;
+    gNodeVisits = 0;
+    for (int y = 0; y < H; y++) {
+        for (int x = 0; x < W; x++) {
+            Ray pr = {{0,0,0}, {(x + 0.5)/W - 0.5, (y + 0.5)/H - 0.5, -1}};
+            long long before = gNodeVisits;
+            bool found = closestHitBVH(pr, cloud, 0.0, inf, hit);
+            primaryVisits += gNodeVisits - before;
+            if (!found) continue;
+            hits++;
+
+            Vec3 p = {pr.orig.x + pr.dir.x * hit.t, pr.orig.y + pr.dir.y * hit.t, pr.orig.z + pr.dir.z * hit.t};
+            Ray shadow = {p, {lightPos.x - p.x, lightPos.y - p.y, lightPos.z - p.z}};
+            shadowed += anyHitBVH(shadow, cloud, 1e-4, 1.0);
+        }
+    }
+    cout << "BVH nodes: " << bvh.size() << " (" << bvh.size() * sizeof(BVHNode) / 1024 << " KiB)"
+         << ", hits: " << hits << ", shadowed: " << shadowed
+         << ", node visits per primary ray: " << double(primaryVisits) / (W*H)
+         << ", per shadow ray: " << double(gNodeVisits - primaryVisits) / max(hits, 1) << "\n";
+
+
+    // Incoherent rays through the binary and the 4-wide BVH
+    buildBVH4();
+    const int NR = 200000;
+    vector<Ray> randomRays;
+    for (int i = 0; i < NR; i++) {
+        Vec3 o = {rnd()*20 - 10, rnd()*20 - 10, -10 - rnd()*20};
+        Vec3 d = {rnd() - 0.5, rnd() - 0.5, rnd() - 0.5};
+        randomRays.push_back({o, d});
+    }
+    long long v0 = gNodeVisits;
+    auto w0 = chrono::steady_clock::now();
+    vector<int> binaryIdx(NR), wideIdx(NR);
+    int binaryShadow = 0, wideShadow = 0;
+    for (int i = 0; i < NR; i++) {
+        binaryIdx[i] = closestHitBVH(randomRays[i], cloud, 1e-4, inf, hit) ? hit.sphereIndex : -1;
+        binaryShadow += anyHitBVH(randomRays[i], cloud, 1e-4, 1.0);
+    }
+    long long v1 = gNodeVisits;
+    auto w1 = chrono::steady_clock::now();
+    for (int i = 0; i < NR; i++) {
+        wideIdx[i] = closestHitBVH4(randomRays[i], cloud, 1e-4, inf, hit) ? hit.sphereIndex : -1;
+        wideShadow += anyHitBVH4(randomRays[i], cloud, 1e-4, 1.0);
+    }
+    long long v2 = gNodeVisits;
+    auto w2 = chrono::steady_clock::now();
+    int wideMismatches = 0;
+    for (int i = 0; i < NR; i++) wideMismatches += binaryIdx[i] != wideIdx[i];
+    double wideRaysM = 2.0 * NR / 1e6;
+    cout << "Incoherent rays: binary " << wideRaysM / chrono::duration<double>(w1 - w0).count() << " Mrays/s ("
+         << double(v1 - v0) / (2 * NR) << " nodes/ray), BVH4 "
+         << wideRaysM / chrono::duration<double>(w2 - w1).count() << " Mrays/s ("
+         << double(v2 - v1) / (2 * NR) << " nodes/ray, " << bvh4.size() << " nodes), "
+         << wideMismatches + abs(binaryShadow - wideShadow) << " differing results\n";
+
+    // Primary rays traced one at a time versus in 2x2 packets
+    const int PW = 512, PH = 512;
+    vector<int> singleIdx(PW * PH), packetIdx(PW * PH);
+    auto cameraRay = [&](int x, int y) {
+        return Ray{{0,0,0}, {(x + 0.5)/PW - 0.5, (y + 0.5)/PH - 0.5, -1}};
+    };
+
+    auto t0 = chrono::steady_clock::now();
+    for (int y = 0; y < PH; y++) {
+        for (int x = 0; x < PW; x++) {
+            SphereHit h;
+            singleIdx[y * PW + x] = closestHitBVH(cameraRay(x, y), cloud, 0.0, inf, h) ? h.sphereIndex : -1;
+        }
+    }
+    auto t1 = chrono::steady_clock::now();
+    for (int y = 0; y < PH; y += 2) {
+        for (int x = 0; x < PW; x += 2) {
+            Ray rays[4] = { cameraRay(x, y), cameraRay(x + 1, y), cameraRay(x, y + 1), cameraRay(x + 1, y + 1) };
+            SphereHit h[4];
+            closestHitPacket4(rays, cloud, 0.0, inf, h);
+            packetIdx[y * PW + x] = h[0].sphereIndex;
+            packetIdx[y * PW + x + 1] = h[1].sphereIndex;
+            packetIdx[(y + 1) * PW + x] = h[2].sphereIndex;
+            packetIdx[(y + 1) * PW + x + 1] = h[3].sphereIndex;
+        }
+    }
+    auto t2 = chrono::steady_clock::now();
+
+    int mismatches = 0;
+    for (int i = 0; i < PW * PH; i++) mismatches += singleIdx[i] != packetIdx[i];
+    double raysM = PW * PH / 1e6;
+    cout << "Primary rays: single " << raysM / chrono::duration<double>(t1 - t0).count() << " Mrays/s, "
+         << "2x2 packets " << raysM / chrono::duration<double>(t2 - t1).count() << " Mrays/s, "
+         << mismatches << " differing pixels\n";
+
+    // Binned SAH versus parallel LBVH: build time and trace cost on the same frame
+    auto buildTimeMs = [&](auto build) {
+        auto b0 = chrono::steady_clock::now();
+        build();
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - b0).count();
+    };
+    auto frameVisits = [&]() {
+        gNodeVisits = 0;
+        int frameHits = 0;
+        for (int y = 0; y < H; y++) {
+            for (int x = 0; x < W; x++) {
+                Ray pr = {{0,0,0}, {(x + 0.5)/W - 0.5, (y + 0.5)/H - 0.5, -1}};
+                frameHits += closestHitBVH(pr, cloud, 0.0, inf, hit);
+            }
+        }
+        return make_pair(frameHits, double(gNodeVisits) / (W*H));
+    };
+    double sahMs = buildTimeMs([&]() { buildBVH(cloud); });
+    auto sahFrame = frameVisits();
+    double lbvhMs = buildTimeMs([&]() { buildLBVH(cloud); });
+    auto lbvhFrame = frameVisits();
+    cout << "SAH build " << sahMs << " ms (" << sahFrame.first << " hits, " << sahFrame.second
+         << " nodes/ray), LBVH build " << lbvhMs << " ms (" << lbvhFrame.first << " hits, "
+         << lbvhFrame.second << " nodes/ray)\n";
+
+    // Animated cloud: refit each frame, rebuild only once the tree has degraded
+    buildBVH(cloud);
+    BVHRefitState refitState = prepareBVHRefit();
+    vector<Vec3> velocity;
+    for (size_t i = 0; i < cloud.size(); i++)
+        velocity.push_back({rnd() - 0.5, rnd() - 0.5, rnd() - 0.5});
+    double refitMs = 0.0;
+    for (int frame = 1; frame <= 8; frame++) {
+        for (size_t i = 0; i < cloud.size(); i++) {
+            cloud[i].center.x += velocity[i].x * 0.5;
+            cloud[i].center.y += velocity[i].y * 0.5;
+            cloud[i].center.z += velocity[i].z * 0.5;
+        }
+        double growth = 0.0;
+        bool rebuilt = false;
+        refitMs += buildTimeMs([&]() { rebuilt = refitOrRebuildBVH(cloud, refitState, 2.0, growth); });
+        cout << "Frame " << frame << ": SAH cost x" << growth << (rebuilt ? ", rebuilt" : ", refit") << "\n";
+    }
+    cout << "Average update " << refitMs / 8 << " ms\n";
+
+    vector<Sphere> bigCloud;
+    for (int i = 0; i < 2000000; i++)
+        bigCloud.push_back({{rnd()*100 - 50, rnd()*100 - 50, -10 - rnd()*100}, 0.01 + rnd()*0.02});
+    cout << "LBVH over " << bigCloud.size() << " spheres: "
+         << buildTimeMs([&]() { buildLBVH(bigCloud); }) << " ms\n";
 
     return 0;
 }
@@ -2,6 +2,25 @@
 #include <vector>
 #include <cmath>
 #include <limits>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <filesystem>
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -19,27 +38,114 @@ struct Ray {
     Vec3 dir;
 };
 
+// Expanded triangle, used transiently when reading from an IndexedMesh
 struct Triangle {
     Vec3 v0, v1, v2;
 };
 
+// Shared-vertex triangle mesh: each vertex is stored once as floats and a triangle is
+// three uint32 indices, 12 bytes plus its share of vertices instead of 72 for Triangle.
+// normals (xyz) and uvs (uv) are optional per-vertex streams, empty when absent.
+struct IndexedMesh {
+    vector<float> positions;
+    vector<uint32_t> indices;
+    vector<float> normals;
+    vector<float> uvs;
+
+    size_t vertexCount() const { return positions.size() / 3; }
+    size_t triangleCount() const { return indices.size() / 3; }
+    size_t bytes() const {
+        return (positions.size() + normals.size() + uvs.size()) * sizeof(float)
+             + indices.size() * sizeof(uint32_t);
+    }
+};
+
 struct AABB {
     Vec3 min;
     Vec3 max;
 };
 
-struct KdNode {
-    AABB box;
-    int left;
-    int right;
-    vector<int> triangles;
-    bool isLeaf;
+const int KD_LEAF = 3;
+
+// 16-byte node stored depth-first: an inner node's left child is the next node
+struct alignas(16) KdNode {
+    union {
+        double split;   // inner: split plane position along axis
+        int triCount;   // leaf: number of entries in KdAccel::triIndices
+    };
+    int axis;           // 0..2 split axis, KD_LEAF for leaves
+    int offset;         // inner: right child index, leaf: first entry in KdAccel::triIndices
+};
+static_assert(sizeof(KdNode) == 16, "KdNode must stay 16 bytes");
+
+// Allocator that hands out Align-byte aligned storage for node arrays
+template <typename T, size_t Align>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), align_val_t(Align)));
+    }
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, align_val_t(Align));
+    }
+    bool operator==(const AlignedAllocator&) const { return true; }
+    bool operator!=(const AlignedAllocator&) const { return false; }
+};
+
+// Leaf-ordered triangle data: entry i mirrors KdAccel::triIndices[i], with edges precomputed.
+// Nine streams of `stride` floats (v0 xyz, e1 xyz, e2 xyz), each padded by one batch
+// so 8-wide loads never run past the end.
+struct TriangleSoA {
+    vector<float, AlignedAllocator<float, 64>> data;
+    size_t stride = 0;
+};
+
+// Read-only arrays that traversal runs on, wherever they are stored
+struct KdView {
+    const KdNode* nodes;
+    const int* triIndices;
+    const float *v0x, *v0y, *v0z;
+    const float *e1x, *e1y, *e1z;
+    const float *e2x, *e2y, *e2z;
+    size_t nodeCount, triCount;
+};
+
+KdView makeKdView(const KdNode* nodes, size_t nodeCount, const int* triIndices, size_t triCount,
+                  const float* soa, size_t stride) {
+    return { nodes, triIndices,
+             soa, soa + stride, soa + 2 * stride,
+             soa + 3 * stride, soa + 4 * stride, soa + 5 * stride,
+             soa + 6 * stride, soa + 7 * stride, soa + 8 * stride,
+             nodeCount, triCount };
+}
+
+// A built kd-tree over some of gMesh's triangles; the root is node 0.
+// The arrays live in the vectors after buildKdTree, or in `mapping` after loadKdCache.
+struct KdAccel {
+    vector<KdNode, AlignedAllocator<KdNode, 64>> nodes;
+    vector<int> triIndices;   // leaves reference contiguous ranges of this array
+    AABB bounds;              // bounds of the root voxel
+    TriangleSoA soa;
+
+    shared_ptr<const char> mapping;   // cache file contents, released with the last copy
+    KdView mapped;
+
+    KdView view() const {
+        if (mapping) return mapped;
+        return makeKdView(nodes.data(), nodes.size(), triIndices.data(), triIndices.size(),
+                          soa.data.data(), soa.stride);
+    }
 };
 
 /* ---------------- GLOBAL STORAGE ---------------- */
 
-vector<Triangle> gTriangles;
-vector<KdNode> kdTree;
+IndexedMesh gMesh;   // all traced geometry; kd-trees reference its triangle indices
+KdAccel gKd;
 
 /* ---------------- UTILITY FUNCTIONS ---------------- */
 
@@ -51,12 +157,6 @@ double maxDouble(double a, double b) {
     return (a > b) ? a : b;
 }
 
-void swapInt(int &a, int &b) {
-    int temp = a;
-    a = b;
-    b = temp;
-}
-
 void swapDouble(double &a, double &b) {
     double temp = a;
     a = b;
@@ -89,9 +189,32 @@ Vec3 cross(Vec3 a, Vec3 b) {
     };
 }
 
+/* ---------------- MESH ACCESS ---------------- */
+
+Vec3 meshVertex(const IndexedMesh& mesh, uint32_t v) {
+    const float* p = &mesh.positions[3 * v];
+    return { p[0], p[1], p[2] };
+}
+
+Triangle meshTriangle(const IndexedMesh& mesh, int tri) {
+    const uint32_t* idx = &mesh.indices[3 * tri];
+    return { meshVertex(mesh, idx[0]), meshVertex(mesh, idx[1]), meshVertex(mesh, idx[2]) };
+}
+
+uint32_t addVertex(IndexedMesh& mesh, Vec3 p) {
+    mesh.positions.insert(mesh.positions.end(), { float(p.x), float(p.y), float(p.z) });
+    return mesh.vertexCount() - 1;
+}
+
+int addTriangle(IndexedMesh& mesh, uint32_t a, uint32_t b, uint32_t c) {
+    mesh.indices.insert(mesh.indices.end(), { a, b, c });
+    return mesh.triangleCount() - 1;
+}
+
 /* ---------------- RAY–TRIANGLE ---------------- */
 
-bool rayTriangleIntersect(const Ray& ray, const Triangle& tri, double& t) {
+bool rayTriangleIntersect(const Ray& ray, const IndexedMesh& mesh, int triIndex, double& t) {
+    Triangle tri = meshTriangle(mesh, triIndex);
     Vec3 e1 = subtract(tri.v1, tri.v0);
     Vec3 e2 = subtract(tri.v2, tri.v0);
 
@@ -113,9 +236,122 @@ bool rayTriangleIntersect(const Ray& ray, const Triangle& tri, double& t) {
     return t > EPS;
 }
 
+/* ---------------- SoA TRIANGLES + 8-WIDE KERNEL ---------------- */
+
+struct TriangleHit {
+    double t;
+    int tri;       // triangle index in gMesh, -1 if nothing was hit
+    float u, v;    // barycentrics of the hit relative to v1 and v2
+};
+
+const int TRI_BATCH = 8;
+
+void buildTriangleSoA(KdAccel& accel) {
+    size_t n = accel.triIndices.size() + TRI_BATCH;
+    accel.soa.stride = n;
+    accel.soa.data.assign(9 * n, 0.0f);
+    float* s = accel.soa.data.data();
+
+    for (size_t i = 0; i < accel.triIndices.size(); i++) {
+        Triangle tri = meshTriangle(gMesh, accel.triIndices[i]);
+        Vec3 e1 = subtract(tri.v1, tri.v0);
+        Vec3 e2 = subtract(tri.v2, tri.v0);
+        s[i]         = tri.v0.x; s[n + i]     = tri.v0.y; s[2 * n + i] = tri.v0.z;
+        s[3 * n + i] = e1.x;     s[4 * n + i] = e1.y;     s[5 * n + i] = e1.z;
+        s[6 * n + i] = e2.x;     s[7 * n + i] = e2.y;     s[8 * n + i] = e2.z;
+    }
+}
+
+// Möller–Trumbore against SoA entries [first, first + count), 8 at a time.
+// Updates hit when a triangle is closer than hit.t.
+bool intersectTriangles8(const KdView& soa, const Ray& ray, int first, int count, TriangleHit& hit) {
+    bool found = false;
+    int end = first + count;
+#if defined(__AVX__)
+    __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+    __m256 dx = _mm256_set1_ps(ray.dir.x), dy = _mm256_set1_ps(ray.dir.y), dz = _mm256_set1_ps(ray.dir.z);
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    __m256 eps = _mm256_set1_ps(EPS);
+    __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (int i = first; i < end; i += TRI_BATCH) {
+        __m256 e1x = _mm256_loadu_ps(&soa.e1x[i]), e1y = _mm256_loadu_ps(&soa.e1y[i]), e1z = _mm256_loadu_ps(&soa.e1z[i]);
+        __m256 e2x = _mm256_loadu_ps(&soa.e2x[i]), e2y = _mm256_loadu_ps(&soa.e2y[i]), e2z = _mm256_loadu_ps(&soa.e2z[i]);
+
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+        __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+        __m256 invDet = _mm256_div_ps(one, det);
+
+        __m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(&soa.v0x[i]));
+        __m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(&soa.v0y[i]));
+        __m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(&soa.v0z[i]));
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), invDet);
+
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+        __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+        __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+
+        __m256 ok = _mm256_cmp_ps(_mm256_and_ps(det, absMask), eps, _CMP_GE_OQ);
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, eps, _CMP_GT_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, _mm256_set1_ps(hit.t), _CMP_LT_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(lane, _mm256_set1_ps(end - i), _CMP_LT_OQ));
+
+        int mask = _mm256_movemask_ps(ok);
+        if (mask == 0) continue;
+
+        alignas(32) float ts[8], us[8], vs[8];
+        _mm256_store_ps(ts, t);
+        _mm256_store_ps(us, u);
+        _mm256_store_ps(vs, v);
+        for (int k = 0; k < TRI_BATCH; k++) {
+            if ((mask >> k & 1) && ts[k] < hit.t) {
+                hit = { ts[k], soa.triIndices[i + k], us[k], vs[k] };
+                found = true;
+            }
+        }
+    }
+#else
+    for (int i = first; i < end; i++) {
+        float dx = ray.dir.x, dy = ray.dir.y, dz = ray.dir.z;
+        float e1x = soa.e1x[i], e1y = soa.e1y[i], e1z = soa.e1z[i];
+        float e2x = soa.e2x[i], e2y = soa.e2y[i], e2z = soa.e2z[i];
+
+        float px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x;
+        float det = e1x * px + e1y * py + e1z * pz;
+        if (fabs(det) < EPS) continue;
+        float invDet = 1.0f / det;
+
+        float sx = ray.origin.x - soa.v0x[i], sy = ray.origin.y - soa.v0y[i], sz = ray.origin.z - soa.v0z[i];
+        float u = (sx * px + sy * py + sz * pz) * invDet;
+        if (u < 0 || u > 1) continue;
+
+        float qx = sy * e1z - sz * e1y, qy = sz * e1x - sx * e1z, qz = sx * e1y - sy * e1x;
+        float v = (dx * qx + dy * qy + dz * qz) * invDet;
+        if (v < 0 || u + v > 1) continue;
+
+        float t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+        if (t > EPS && t < hit.t) {
+            hit = { t, soa.triIndices[i], u, v };
+            found = true;
+        }
+    }
+#endif
+    return found;
+}
+
 /* ---------------- RAY–AABB ---------------- */
 
-bool rayAABB(const Ray& ray, const AABB& box) {
+// Clips [tNear, tFar] against the box; false if the clipped interval is empty
+bool rayAABB(const Ray& ray, const AABB& box, double& tNear, double& tFar) {
     double tmin = (box.min.x - ray.origin.x) / ray.dir.x;
     double tmax = (box.max.x - ray.origin.x) / ray.dir.x;
     if (tmin > tmax) swapDouble(tmin, tmax);
@@ -133,142 +369,1670 @@ bool rayAABB(const Ray& ray, const AABB& box) {
     if (tzmin > tzmax) swapDouble(tzmin, tzmax);
 
     if (tmin > tzmax || tzmin > tmax) return false;
+    if (tzmin > tmin) tmin = tzmin;
+    if (tzmax < tmax) tmax = tzmax;
 
-    return true;
+    tNear = maxDouble(tNear, tmin);
+    tFar = minDouble(tFar, tmax);
+    return tNear <= tFar;
 }
 
 /* ---------------- AABB COMPUTATION ---------------- */
 
+void growAABB(AABB& box, const IndexedMesh& mesh, int tri) {
+    for (int i = 0; i < 3; i++) {
+        Vec3 v = meshVertex(mesh, mesh.indices[3 * tri + i]);
+        box.min.x = minDouble(box.min.x, v.x);
+        box.min.y = minDouble(box.min.y, v.y);
+        box.min.z = minDouble(box.min.z, v.z);
+
+        box.max.x = maxDouble(box.max.x, v.x);
+        box.max.y = maxDouble(box.max.y, v.y);
+        box.max.z = maxDouble(box.max.z, v.z);
+    }
+}
+
 AABB computeAABB(const vector<int>& indices) {
     AABB box;
     box.min = { INF, INF, INF };
     box.max = { -INF, -INF, -INF };
 
-    for (int idx : indices) {
-        const Triangle& t = gTriangles[idx];
-        Vec3 verts[3] = {t.v0, t.v1, t.v2};
-        for (int i = 0; i < 3; i++) {
-            box.min.x = minDouble(box.min.x, verts[i].x);
-            box.min.y = minDouble(box.min.y, verts[i].y);
-            box.min.z = minDouble(box.min.z, verts[i].z);
+    for (int idx : indices)
+        growAABB(box, gMesh, idx);
+    return box;
+}
+
+/* ---------------- KD-TREE BUILD (SAH, EVENT SORTING) ---------------- */
+
+// Cost model and limits for the SAH kd-tree builder
+const double KD_TRAVERSAL_COST = 1.0;
+const double KD_INTERSECT_COST = 1.5;
+const double KD_EMPTY_BONUS = 0.8;
+const int KD_MAX_DEPTH = 40;
+
+enum KdEventType { KD_END = 0, KD_PLANAR = 1, KD_START = 2 };
+enum KdSide { KD_BOTH = 0, KD_LEFT_ONLY = 1, KD_RIGHT_ONLY = 2 };
+
+struct KdEvent {
+    double pos;
+    int tri;
+    int type;
+};
+
+bool operator<(const KdEvent& a, const KdEvent& b) {
+    return (a.pos < b.pos) || (a.pos == b.pos && a.type < b.type);
+}
+
+typedef vector<KdEvent> KdEventList[3];
+
+vector<AABB> gTriBounds;   // per-triangle bounds, filled by buildKdTree
+vector<char> gTriSide;     // scratch classification, one entry per triangle
+
+double axisOf(const Vec3& v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
 
-            box.max.x = maxDouble(box.max.x, verts[i].x);
-            box.max.y = maxDouble(box.max.y, verts[i].y);
-            box.max.z = maxDouble(box.max.z, verts[i].z);
+double& axisRef(Vec3& v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+double surfaceArea(const AABB& b) {
+    double dx = b.max.x - b.min.x, dy = b.max.y - b.min.y, dz = b.max.z - b.min.z;
+    return 2.0 * (dx*dy + dy*dz + dz*dx);
+}
+
+AABB clipAABB(const AABB& a, const AABB& b) {
+    AABB r;
+    r.min = { maxDouble(a.min.x, b.min.x), maxDouble(a.min.y, b.min.y), maxDouble(a.min.z, b.min.z) };
+    r.max = { minDouble(a.max.x, b.max.x), minDouble(a.max.y, b.max.y), minDouble(a.max.z, b.max.z) };
+    return r;
+}
+
+void addEvents(KdEventList& events, int tri, const AABB& box) {
+    for (int k = 0; k < 3; k++) {
+        double lo = axisOf(box.min, k), hi = axisOf(box.max, k);
+        if (lo == hi) {
+            events[k].push_back({lo, tri, KD_PLANAR});
+        } else {
+            events[k].push_back({lo, tri, KD_START});
+            events[k].push_back({hi, tri, KD_END});
         }
     }
-    return box;
 }
 
-/* ---------------- MANUAL SORT FOR KD-TREE ---------------- */
+// SAH cost of splitting voxel at plane (axis, pos); planar triangles go to the cheaper side
+double splitCost(const AABB& voxel, int axis, double pos, int nl, int nr, int np, bool& planarLeft) {
+    AABB vl = voxel, vr = voxel;
+    axisRef(vl.max, axis) = pos;
+    axisRef(vr.min, axis) = pos;
+    double invArea = 1.0 / surfaceArea(voxel);
+    double pl = surfaceArea(vl) * invArea;
+    double pr = surfaceArea(vr) * invArea;
+    if (pl == 0.0 && pr == 0.0) return INF;
+
+    double costL = KD_TRAVERSAL_COST + KD_INTERSECT_COST * (pl * (nl + np) + pr * nr);
+    double costR = KD_TRAVERSAL_COST + KD_INTERSECT_COST * (pl * nl + pr * (nr + np));
+    if ((nl + np == 0) || nr == 0) costL *= KD_EMPTY_BONUS;
+    if (nl == 0 || (nr + np == 0)) costR *= KD_EMPTY_BONUS;
+
+    planarLeft = costL < costR;
+    return planarLeft ? costL : costR;
+}
 
-void sortTriangles(vector<int>& indices, int axis) {
-    int n = indices.size();
-    for (int i = 0; i < n - 1; i++) {
-        for (int j = 0; j < n - i - 1; j++) {
-            Triangle& A = gTriangles[indices[j]];
-            Triangle& B = gTriangles[indices[j + 1]];
+// Linear sweep over the presorted events of every axis
+double findBestPlane(const KdEventList& events, int numTris, const AABB& voxel,
+                     int& bestAxis, double& bestPos, bool& bestPlanarLeft) {
+    double bestCost = INF;
+    for (int k = 0; k < 3; k++) {
+        double lo = axisOf(voxel.min, k), hi = axisOf(voxel.max, k);
+        if (hi <= lo) continue;
+
+        const vector<KdEvent>& E = events[k];
+        int nl = 0, np = 0, nr = numTris;
+        size_t i = 0;
+        while (i < E.size()) {
+            double p = E[i].pos;
+            int pEnd = 0, pPlanar = 0, pStart = 0;
+            while (i < E.size() && E[i].pos == p && E[i].type == KD_END) { pEnd++; i++; }
+            while (i < E.size() && E[i].pos == p && E[i].type == KD_PLANAR) { pPlanar++; i++; }
+            while (i < E.size() && E[i].pos == p && E[i].type == KD_START) { pStart++; i++; }
+
+            np = pPlanar;
+            nr -= pPlanar + pEnd;
+            if (p > lo && p < hi) {
+                bool planarLeft;
+                double cost = splitCost(voxel, k, p, nl, nr, np, planarLeft);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = k;
+                    bestPos = p;
+                    bestPlanarLeft = planarLeft;
+                }
+            }
+            nl += pStart + pPlanar;
+            np = 0;
+        }
+    }
+    return bestCost;
+}
 
-            Vec3 ca = add(add(A.v0, A.v1), A.v2);
-            Vec3 cb = add(add(B.v0, B.v1), B.v2);
+int makeLeaf(KdAccel& accel, const KdEventList& events) {
+    KdNode leaf = {};   // zero the union's unused bytes so cache files are reproducible
+    leaf.axis = KD_LEAF;
+    leaf.offset = accel.triIndices.size();
+    for (const KdEvent& e : events[0])
+        if (e.type != KD_END) accel.triIndices.push_back(e.tri);
+    leaf.triCount = accel.triIndices.size() - leaf.offset;
+    accel.nodes.push_back(leaf);
+    return accel.nodes.size() - 1;
+}
+
+int buildKdNode(KdAccel& accel, KdEventList& events, int numTris, const AABB& voxel, int depth) {
+    int axis = -1;
+    double pos = 0;
+    bool planarLeft = false;
+    double cost = INF;
+    if (depth < KD_MAX_DEPTH && numTris > 0)
+        cost = findBestPlane(events, numTris, voxel, axis, pos, planarLeft);
+
+    if (axis < 0 || cost > KD_INTERSECT_COST * numTris)
+        return makeLeaf(accel, events);
+
+    // Classify triangles against the chosen plane using the split axis events
+    for (const KdEvent& e : events[axis]) gTriSide[e.tri] = KD_BOTH;
+    for (const KdEvent& e : events[axis]) {
+        if (e.type == KD_END && e.pos <= pos) gTriSide[e.tri] = KD_LEFT_ONLY;
+        else if (e.type == KD_START && e.pos >= pos) gTriSide[e.tri] = KD_RIGHT_ONLY;
+        else if (e.type == KD_PLANAR) {
+            if (e.pos < pos || (e.pos == pos && planarLeft)) gTriSide[e.tri] = KD_LEFT_ONLY;
+            else gTriSide[e.tri] = KD_RIGHT_ONLY;
+        }
+    }
 
-            double va = (axis == 0 ? ca.x : (axis == 1 ? ca.y : ca.z));
-            double vb = (axis == 0 ? cb.x : (axis == 1 ? cb.y : cb.z));
+    AABB voxelL = voxel, voxelR = voxel;
+    axisRef(voxelL.max, axis) = pos;
+    axisRef(voxelR.min, axis) = pos;
+
+    // Straddling triangles get fresh events clipped to each child voxel
+    KdEventList straddleL, straddleR;
+    int numL = 0, numR = 0;
+    for (const KdEvent& e : events[0]) {
+        if (e.type == KD_END) continue;
+        char side = gTriSide[e.tri];
+        if (side == KD_LEFT_ONLY) numL++;
+        else if (side == KD_RIGHT_ONLY) numR++;
+        else {
+            numL++;
+            numR++;
+            addEvents(straddleL, e.tri, clipAABB(gTriBounds[e.tri], voxelL));
+            addEvents(straddleR, e.tri, clipAABB(gTriBounds[e.tri], voxelR));
+        }
+    }
 
-            if (va > vb) {
-                swapInt(indices[j], indices[j + 1]);
+    // Split the sorted lists in order, then merge in the (small) sorted straddler lists
+    KdEventList eventsL, eventsR;
+    for (int k = 0; k < 3; k++) {
+        vector<KdEvent> onlyL, onlyR;
+        for (const KdEvent& e : events[k]) {
+            char side = gTriSide[e.tri];
+            if (side == KD_LEFT_ONLY) onlyL.push_back(e);
+            else if (side == KD_RIGHT_ONLY) onlyR.push_back(e);
+        }
+        vector<KdEvent>().swap(events[k]);
+
+        sort(straddleL[k].begin(), straddleL[k].end());
+        sort(straddleR[k].begin(), straddleR[k].end());
+        eventsL[k].resize(onlyL.size() + straddleL[k].size());
+        eventsR[k].resize(onlyR.size() + straddleR[k].size());
+        merge(onlyL.begin(), onlyL.end(), straddleL[k].begin(), straddleL[k].end(), eventsL[k].begin());
+        merge(onlyR.begin(), onlyR.end(), straddleR[k].begin(), straddleR[k].end(), eventsR[k].begin());
+    }
+
+    int nodeIndex = accel.nodes.size();
+    accel.nodes.push_back({});
+    buildKdNode(accel, eventsL, numL, voxelL, depth + 1); // lands at nodeIndex + 1
+    int right = buildKdNode(accel, eventsR, numR, voxelR, depth + 1);
+
+    KdNode& node = accel.nodes[nodeIndex];
+    node.split = pos;
+    node.axis = axis;
+    node.offset = right;
+    return nodeIndex;
+}
+
+// Builds an SAH kd-tree over the given triangles; events are sorted once, O(n log n)
+void buildKdTree(KdAccel& accel, const vector<int>& indices) {
+    accel.mapping.reset();
+    accel.nodes.clear();
+    accel.triIndices.clear();
+    gTriBounds.resize(gMesh.triangleCount());
+    gTriSide.assign(gMesh.triangleCount(), KD_BOTH);
+
+    KdEventList events;
+    for (int idx : indices) {
+        gTriBounds[idx] = { { INF, INF, INF }, { -INF, -INF, -INF } };
+        growAABB(gTriBounds[idx], gMesh, idx);
+        addEvents(events, idx, gTriBounds[idx]);
+    }
+    for (int k = 0; k < 3; k++)
+        sort(events[k].begin(), events[k].end());
+
+    accel.bounds = computeAABB(indices);
+    buildKdNode(accel, events, indices.size(), accel.bounds, 0);
+    buildTriangleSoA(accel);
+}
+
+/* ---------------- KD-TREE TRAVERSAL ---------------- */
+
+long long gKdNodeVisits = 0;
+
+struct KdStackEntry {
+    int node;
+    double tmin, tmax;
+};
+
+// Front-to-back traversal: near child first, far child deferred with its t-interval.
+// hit.t limits the search on entry and holds the nearest hit on return.
+bool traverseKd(const KdAccel& accel, const Ray& ray, TriangleHit& hit) {
+    double tmin = 0.0, tmax = hit.t;
+    if (!rayAABB(ray, accel.bounds, tmin, tmax))
+        return false;
+
+    KdView view = accel.view();
+    double invDir[3] = { 1.0 / ray.dir.x, 1.0 / ray.dir.y, 1.0 / ray.dir.z };
+    KdStackEntry stack[KD_MAX_DEPTH + 1];
+    int stackSize = 0;
+    int nodeIndex = 0;
+    bool found = false;
+
+    while (true) {
+        gKdNodeVisits++;
+        const KdNode& node = view.nodes[nodeIndex];
+
+        if (node.axis != KD_LEAF) {
+            double o = axisOf(ray.origin, node.axis);
+            double d = axisOf(ray.dir, node.axis);
+            bool leftFirst = (o < node.split) || (o == node.split && d <= 0);
+            int nearChild = leftFirst ? nodeIndex + 1 : node.offset;
+            int farChild = leftFirst ? node.offset : nodeIndex + 1;
+
+            double tSplit = (d != 0) ? (node.split - o) * invDir[node.axis] : INF;
+            if (tSplit > tmax || tSplit <= 0) {
+                nodeIndex = nearChild;
+            } else if (tSplit < tmin) {
+                nodeIndex = farChild;
+            } else {
+                stack[stackSize++] = { farChild, tSplit, tmax };
+                nodeIndex = nearChild;
+                tmax = tSplit;
             }
+            continue;
         }
+
+        found |= intersectTriangles8(view, ray, node.offset, node.triCount, hit);
+
+        // A hit inside this voxel is closer than anything still on the stack
+        if (found && hit.t <= tmax)
+            return true;
+
+        do {
+            if (stackSize == 0) return found;
+            KdStackEntry e = stack[--stackSize];
+            nodeIndex = e.node;
+            tmin = e.tmin;
+            tmax = e.tmax;
+        } while (tmin > hit.t);
+        if (tmax > hit.t) tmax = hit.t;
     }
 }
 
-/* ---------------- KD-TREE BUILD ---------------- */
+bool traverseKd(const KdAccel& accel, const Ray& ray, double& closestT) {
+    TriangleHit hit = { closestT, -1, 0, 0 };
+    if (!traverseKd(accel, ray, hit)) return false;
+    closestT = hit.t;
+    return true;
+}
 
-int buildKdTree(vector<int>& indices, int depth) {
-    int nodeIndex = kdTree.size();
-    kdTree.push_back({});
-    KdNode& node = kdTree.back();
+/* ---------------- HIT ATTRIBUTES ---------------- */
+
+// Shading normal at a hit: the interpolated vertex normal when the mesh has them,
+// otherwise the geometric normal. Unit length.
+Vec3 interpolateNormal(const IndexedMesh& mesh, const TriangleHit& hit) {
+    const uint32_t* idx = &mesh.indices[3 * hit.tri];
+    Vec3 n;
+    if (!mesh.normals.empty()) {
+        double w[3] = { 1.0 - hit.u - hit.v, hit.u, hit.v };
+        n = { 0, 0, 0 };
+        for (int k = 0; k < 3; k++) {
+            const float* vn = &mesh.normals[3 * idx[k]];
+            n = add(n, scale(Vec3{ vn[0], vn[1], vn[2] }, w[k]));
+        }
+    } else {
+        Triangle tri = meshTriangle(mesh, hit.tri);
+        n = cross(subtract(tri.v1, tri.v0), subtract(tri.v2, tri.v0));
+    }
+    return scale(n, 1.0 / sqrt(dot(n, n)));
+}
 
-    node.box = computeAABB(indices);
+// Texture coordinates at a hit; (u, v) barycentrics when the mesh has no uvs
+void interpolateUV(const IndexedMesh& mesh, const TriangleHit& hit, float& s, float& t) {
+    if (mesh.uvs.empty()) {
+        s = hit.u;
+        t = hit.v;
+        return;
+    }
+    const uint32_t* idx = &mesh.indices[3 * hit.tri];
+    float w[3] = { 1.0f - hit.u - hit.v, hit.u, hit.v };
+    s = t = 0;
+    for (int k = 0; k < 3; k++) {
+        s += w[k] * mesh.uvs[2 * idx[k]];
+        t += w[k] * mesh.uvs[2 * idx[k] + 1];
+    }
+}
 
-    if (indices.size() <= 2 || depth >= 20) {
-        node.isLeaf = true;
-        node.triangles = indices;
-        node.left = node.right = -1;
-        return nodeIndex;
+/* ---------------- KD-TREE CACHE (MMAP-LOADABLE) ---------------- */
+
+// File layout: a fixed header at offset 0, then the node, triangle index and SoA
+// sections. Sections are addressed by byte offsets from the start of the file and
+// aligned to KD_CACHE_ALIGN, so a mapped file is traced in place. Native byte order.
+const char KD_CACHE_MAGIC[8] = { 'K', 'D', 'C', 'A', 'C', 'H', 'E', '\0' };
+const uint32_t KD_CACHE_VERSION = 1;
+const size_t KD_CACHE_ALIGN = 64;
+
+struct KdCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;     // sizeof(KdNode), guards against layout changes
+    uint64_t key;          // kdCacheKey() of the geometry and build parameters
+    uint64_t fileSize;
+    double bounds[6];
+    uint64_t nodeCount, nodeOffset;
+    uint64_t triCount, triIndexOffset;
+    uint64_t soaStride, soaOffset;
+};
+
+size_t alignCacheOffset(size_t offset) {
+    return (offset + KD_CACHE_ALIGN - 1) & ~(KD_CACHE_ALIGN - 1);
+}
+
+// FNV-1a over the inputs that determine the tree; any change forces a rebuild
+uint64_t hashBytes(uint64_t h, const void* data, size_t size) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+uint64_t kdCacheKey(const vector<int>& indices) {
+    uint64_t h = 14695981039346656037ull;
+    const double params[4] = { KD_TRAVERSAL_COST, KD_INTERSECT_COST, KD_EMPTY_BONUS, double(KD_MAX_DEPTH) };
+    const uint32_t layout[3] = { KD_CACHE_VERSION, uint32_t(sizeof(KdNode)), uint32_t(TRI_BATCH) };
+    h = hashBytes(h, params, sizeof(params));
+    h = hashBytes(h, layout, sizeof(layout));
+    for (int idx : indices) {
+        float v[9];
+        for (int k = 0; k < 3; k++)
+            memcpy(&v[3 * k], &gMesh.positions[3 * gMesh.indices[3 * idx + k]], 3 * sizeof(float));
+        h = hashBytes(h, &idx, sizeof(idx));
+        h = hashBytes(h, v, sizeof(v));
     }
+    return h;
+}
 
-    int axis = depth % 3;
-    sortTriangles(indices, axis);
+// Writes to a temporary file and renames it, so readers never see a partial cache
+bool saveKdCache(const KdAccel& accel, const char* path, uint64_t key) {
+    KdView view = accel.view();
+    KdCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KD_CACHE_MAGIC, sizeof(header.magic));
+    header.version = KD_CACHE_VERSION;
+    header.nodeSize = sizeof(KdNode);
+    header.key = key;
+    const double bounds[6] = { accel.bounds.min.x, accel.bounds.min.y, accel.bounds.min.z,
+                               accel.bounds.max.x, accel.bounds.max.y, accel.bounds.max.z };
+    memcpy(header.bounds, bounds, sizeof(bounds));
+    header.nodeCount = view.nodeCount;
+    header.triCount = view.triCount;
+    header.soaStride = view.v0y - view.v0x;
+    header.nodeOffset = alignCacheOffset(sizeof(KdCacheHeader));
+    header.triIndexOffset = alignCacheOffset(header.nodeOffset + header.nodeCount * sizeof(KdNode));
+    header.soaOffset = alignCacheOffset(header.triIndexOffset + header.triCount * sizeof(int));
+    header.fileSize = header.soaOffset + 9 * header.soaStride * sizeof(float);
+
+    // A fresh, exclusively created temporary never follows a planted link or
+    // collides with another process writing the same cache
+    string tmpPath = string(path) + ".XXXXXX";
+#if defined(__unix__)
+    int fd = mkstemp(&tmpPath[0]);
+    FILE* f = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+    if (!f && fd >= 0) { close(fd); remove(tmpPath.c_str()); }
+#else
+    tmpPath = string(path) + ".tmp";
+    FILE* f = fopen(tmpPath.c_str(), "wbx");
+#endif
+    if (!f) return false;
+    struct Section { const void* data; size_t offset, size; };
+    const Section sections[4] = {
+        { &header, 0, sizeof(header) },
+        { view.nodes, header.nodeOffset, header.nodeCount * sizeof(KdNode) },
+        { view.triIndices, header.triIndexOffset, header.triCount * sizeof(int) },
+        { view.v0x, header.soaOffset, 9 * header.soaStride * sizeof(float) },
+    };
+    static const char zeros[KD_CACHE_ALIGN] = {};
+    size_t written = 0;
+    bool ok = true;
+    for (const Section& s : sections) {
+        ok = ok && fwrite(zeros, 1, s.offset - written, f) == s.offset - written;
+        ok = ok && fwrite(s.data, 1, s.size, f) == s.size;
+        written = s.offset + s.size;
+    }
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmpPath.c_str(), path) != 0) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
 
-    int mid = indices.size() / 2;
-    vector<int> leftList(indices.begin(), indices.begin() + mid);
-    vector<int> rightList(indices.begin() + mid, indices.end());
+// Maps a whole file read-only (or reads it into one aligned block without mmap)
+shared_ptr<const char> mapFile(const char* path, size_t& size) {
+#if defined(__unix__)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) { close(fd); return nullptr; }
+    size = st.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return nullptr;
+    return shared_ptr<const char>(static_cast<const char*>(map),
+                                  [size](const char* p) { munmap(const_cast<char*>(p), size); });
+#else
+    FILE* f = fopen(path, "rb");
+    if (!f) return nullptr;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (len <= 0) { fclose(f); return nullptr; }
+    size = len;
+    char* data = static_cast<char*>(::operator new(size, align_val_t(KD_CACHE_ALIGN)));
+    bool ok = fread(data, 1, size, f) == size;
+    fclose(f);
+    if (!ok) { ::operator delete(data, align_val_t(KD_CACHE_ALIGN)); return nullptr; }
+    return shared_ptr<const char>(data, [](const char* p) {
+        ::operator delete(const_cast<char*>(p), align_val_t(KD_CACHE_ALIGN));
+    });
+#endif
+}
 
-    node.isLeaf = false;
-    // node.triangles.clear();
-    node.left = buildKdTree(leftList, depth + 1);
-    node.right = buildKdTree(rightList, depth + 1);
+bool cacheSectionFits(uint64_t offset, uint64_t count, size_t elemSize, uint64_t fileSize) {
+    return offset % KD_CACHE_ALIGN == 0 && offset <= fileSize
+        && count <= (fileSize - offset) / elemSize;
+}
 
-    return nodeIndex;
+// Traversal trusts node contents, so a cache is only used if every node keeps it in
+// bounds: inner children lie after their parent (so the walk terminates) and within
+// the array, no leaf is deeper than the traversal stack, leaf ranges stay inside
+// triIndices, and every triangle index is one of gMesh's
+bool validKdCacheNodes(const KdNode* nodes, uint64_t nodeCount, const int* triIndices, uint64_t triCount) {
+    for (uint64_t i = 0; i < triCount; i++)
+        if (triIndices[i] < 0 || size_t(triIndices[i]) >= gMesh.triangleCount()) return false;
+
+    vector<uint8_t> depth(nodeCount, 0);
+    for (uint64_t i = 0; i < nodeCount; i++) {
+        const KdNode& n = nodes[i];
+        if (n.axis < 0 || n.axis > KD_LEAF) return false;
+        if (n.axis == KD_LEAF) {
+            if (n.offset < 0 || n.triCount < 0 || uint64_t(n.offset) + uint64_t(n.triCount) > triCount)
+                return false;
+            continue;
+        }
+        if (n.offset < 0 || uint64_t(n.offset) <= i + 1 || uint64_t(n.offset) >= nodeCount) return false;
+        if (depth[i] >= KD_MAX_DEPTH) return false;
+        depth[i + 1] = max<uint8_t>(depth[i + 1], depth[i] + 1);
+        depth[n.offset] = max<uint8_t>(depth[n.offset], depth[i] + 1);
+    }
+    return true;
 }
 
-/* ---------------- KD-TREE TRAVERSAL ---------------- */
+// Points accel at the cached arrays; false if the file is missing, malformed or stale
+bool loadKdCache(KdAccel& accel, const char* path, uint64_t key) {
+    size_t size = 0;
+    shared_ptr<const char> data = mapFile(path, size);
+    if (!data || size < sizeof(KdCacheHeader)) return false;
+
+    KdCacheHeader header;
+    memcpy(&header, data.get(), sizeof(header));
+    if (memcmp(header.magic, KD_CACHE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != KD_CACHE_VERSION || header.nodeSize != sizeof(KdNode)
+        || header.key != key || header.fileSize != size || header.nodeCount == 0
+        || !cacheSectionFits(header.nodeOffset, header.nodeCount, sizeof(KdNode), size)
+        || !cacheSectionFits(header.triIndexOffset, header.triCount, sizeof(int), size)
+        || header.soaStride > UINT64_MAX / 9 || header.soaStride < header.triCount + TRI_BATCH
+        || !cacheSectionFits(header.soaOffset, 9 * header.soaStride, sizeof(float), size))
+        return false;
 
-bool traverseKd(const Ray& ray, int nodeIndex, double& closestT) {
-    const KdNode& node = kdTree[nodeIndex];
+    const char* base = data.get();
+    if (!validKdCacheNodes(reinterpret_cast<const KdNode*>(base + header.nodeOffset), header.nodeCount,
+                           reinterpret_cast<const int*>(base + header.triIndexOffset), header.triCount))
+        return false;
+    accel.nodes.clear();
+    accel.triIndices.clear();
+    accel.soa = TriangleSoA();
+    accel.bounds = { { header.bounds[0], header.bounds[1], header.bounds[2] },
+                     { header.bounds[3], header.bounds[4], header.bounds[5] } };
+    accel.mapped = makeKdView(reinterpret_cast<const KdNode*>(base + header.nodeOffset), header.nodeCount,
+                              reinterpret_cast<const int*>(base + header.triIndexOffset), header.triCount,
+                              reinterpret_cast<const float*>(base + header.soaOffset), header.soaStride);
+    accel.mapping = data;
+    return true;
+}
 
-    if (!rayAABB(ray, node.box))
+// Uses the cache at path when its key matches the geometry, otherwise builds and rewrites it.
+// An empty path builds without caching.
+bool loadOrBuildKdTree(KdAccel& accel, const vector<int>& indices, const char* path) {
+    if (!*path) {
+        buildKdTree(accel, indices);
         return false;
+    }
+    uint64_t key = kdCacheKey(indices);
+    if (loadKdCache(accel, path, key))
+        return true;
+    buildKdTree(accel, indices);
+    if (!saveKdCache(accel, path, key))
+        cerr << "Could not write kd-tree cache " << path << endl;
+    return false;
+}
 
-    bool hit = false;
+/* ---------------- MESH LOADING (MMAP, PARALLEL OBJ/PLY) ---------------- */
 
-    if (node.isLeaf) {
-        for (int idx : node.triangles) {
-            double t;
-            if (rayTriangleIntersect(ray, gTriangles[idx], t)) {
-                if (t < closestT) {
-                    closestT = t;
-                    hit = true;
+// Runs fn(c) for every chunk c in [0, n), one thread per chunk
+template <typename Fn>
+void parallelChunks(size_t n, Fn fn) {
+    vector<thread> pool;
+    for (size_t c = 1; c < n; c++)
+        pool.emplace_back(fn, c);
+    if (n > 0) fn(0);
+    for (thread& th : pool) th.join();
+}
+
+size_t loaderChunkCount(size_t bytes) {
+    size_t threads = max(1u, thread::hardware_concurrency());
+    return min(threads, max<size_t>(1, bytes >> 20));   // at least 1 MiB per chunk
+}
+
+// Splits [begin, end) into n ranges that each start at the beginning of a line;
+// chunk c is [cuts[c], cuts[c + 1]) and may be empty
+vector<const char*> splitLines(const char* begin, const char* end, size_t n) {
+    vector<const char*> cuts(1, begin);
+    for (size_t c = 1; c < n; c++) {
+        const char* p = max(cuts.back(), begin + (end - begin) * c / n);
+        const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+        cuts.push_back(nl ? nl + 1 : end);
+    }
+    cuts.push_back(end);
+    return cuts;
+}
+
+inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char* skipBlanks(const char* p, const char* end) {
+    while (p < end && isBlank(*p)) p++;
+    return p;
+}
+
+inline const char* skipToken(const char* p, const char* end) {
+    while (p < end && !isBlank(*p) && *p != '\n') p++;
+    return p;
+}
+
+inline const char* nextLine(const char* p, const char* end) {
+    const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+    return nl ? nl + 1 : end;
+}
+
+// Decimal float parser for vertex data: optional sign, digits, fraction and exponent.
+// Keeps 19 significant digits in an integer and scales once in double, which is well
+// inside float precision. No locale, no allocation; returns nullptr if no number starts at p.
+const char* parseFloat(const char* p, const char* end, float& out) {
+    static const double POW10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exp10 = 0;
+    bool any = false;
+    for (; p < end && unsigned(*p - '0') < 10; p++, any = true) {
+        if (digits < 19) { mantissa = mantissa * 10 + (*p - '0'); digits += mantissa != 0; }
+        else exp10++;
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && unsigned(*p - '0') < 10; p++, any = true) {
+            if (digits < 19) { mantissa = mantissa * 10 + (*p - '0'); digits += mantissa != 0; exp10--; }
+        }
+    }
+    if (!any) return nullptr;
+
+    if (p < end && (*p | 0x20) == 'e') {
+        const char* q = p + 1;
+        bool negExp = false;
+        if (q < end && (*q == '-' || *q == '+')) negExp = *q++ == '-';
+        int e = 0;
+        const char* digitsStart = q;
+        for (; q < end && unsigned(*q - '0') < 10; q++) e = min(e * 10 + (*q - '0'), 9999);
+        if (q > digitsStart) {
+            exp10 += negExp ? -e : e;
+            p = q;
+        }
+    }
+
+    double v = double(mantissa);
+    if (exp10 >= 0) v = exp10 <= 22 ? v * POW10[exp10] : v * pow(10.0, exp10);
+    else v = exp10 >= -22 ? v / POW10[-exp10] : v * pow(10.0, exp10);
+    out = float(negative ? -v : v);
+    return p;
+}
+
+const char* parseInt(const char* p, const char* end, long long& out) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    const char* start = p;
+    long long v = 0;
+    for (; p < end && unsigned(*p - '0') < 10; p++) v = v * 10 + (*p - '0');
+    if (p == start) return nullptr;
+    out = negative ? -v : v;
+    return p;
+}
+
+// Prefix sums of per-chunk counts, giving each chunk its first output slot
+vector<size_t> exclusiveScan(const vector<size_t>& counts) {
+    vector<size_t> offsets(counts.size() + 1, 0);
+    for (size_t c = 0; c < counts.size(); c++) offsets[c + 1] = offsets[c] + counts[c];
+    return offsets;
+}
+
+inline bool objKeyword(const char* p, const char* end, char key) {
+    return p + 1 < end && p[0] == key && isBlank(p[1]);
+}
+
+// Two parallel passes over line-aligned chunks: the first counts vertices and fan
+// triangles so the buffers are sized exactly, the second parses into place. Relative
+// (negative) face indices resolve against the vertex count at the start of each chunk.
+bool loadOBJ(const char* data, size_t size, IndexedMesh& mesh) {
+    const char* end = data + size;
+    size_t chunks = loaderChunkCount(size);
+    vector<const char*> cuts = splitLines(data, end, chunks);
+    vector<size_t> vertexCounts(chunks, 0), triCounts(chunks, 0);
+
+    parallelChunks(chunks, [&](size_t c) {
+        size_t vertices = 0, tris = 0;
+        for (const char* p = cuts[c]; p < cuts[c + 1]; p = nextLine(p, end)) {
+            p = skipBlanks(p, end);
+            if (objKeyword(p, end, 'v')) {
+                vertices++;
+            } else if (objKeyword(p, end, 'f')) {
+                size_t corners = 0;
+                for (p = skipBlanks(p + 1, end); p < end && *p != '\n' && *p != '#';
+                     p = skipBlanks(skipToken(p, end), end))
+                    corners++;
+                if (corners >= 3) tris += corners - 2;
+            }
+        }
+        vertexCounts[c] = vertices;
+        triCounts[c] = tris;
+    });
+
+    vector<size_t> vertexBase = exclusiveScan(vertexCounts);
+    vector<size_t> triBase = exclusiveScan(triCounts);
+    size_t numVertices = vertexBase[chunks], numTris = triBase[chunks];
+    if (numVertices > UINT32_MAX) {
+        cerr << "OBJ has too many vertices for 32-bit indices\n";
+        return false;
+    }
+    mesh.positions.resize(3 * numVertices);
+    mesh.indices.resize(3 * numTris);
+
+    vector<const char*> errorAt(chunks, nullptr);
+    parallelChunks(chunks, [&](size_t c) {
+        float* pos = mesh.positions.data() + 3 * vertexBase[c];
+        uint32_t* idx = mesh.indices.data() + 3 * triBase[c];
+        long long seen = vertexBase[c];   // vertices defined before the current line
+        for (const char* p = cuts[c]; p < cuts[c + 1]; p = nextLine(p, end)) {
+            const char* line = p;
+            p = skipBlanks(p, end);
+            if (objKeyword(p, end, 'v')) {
+                p++;
+                for (int k = 0; k < 3; k++) {
+                    p = parseFloat(skipBlanks(p, end), end, pos[k]);
+                    if (!p) { errorAt[c] = line; return; }
+                }
+                pos += 3;
+                seen++;
+            } else if (objKeyword(p, end, 'f')) {
+                uint32_t first = 0, prev = 0;
+                int corner = 0;
+                for (p = skipBlanks(p + 1, end); p < end && *p != '\n' && *p != '#';
+                     p = skipBlanks(skipToken(p, end), end), corner++) {
+                    long long i;
+                    if (!parseInt(p, end, i) || i == 0) { errorAt[c] = line; return; }   // 0 is not an OBJ index
+                    i = i > 0 ? i - 1 : seen + i;   // 1-based, or relative to the latest vertex
+                    if (i < 0 || i >= (long long)numVertices) { errorAt[c] = line; return; }
+                    if (corner == 0) first = i;
+                    else if (corner >= 2) { idx[0] = first; idx[1] = prev; idx[2] = i; idx += 3; }
+                    prev = i;
                 }
             }
         }
-        return hit;
+    });
+
+    for (const char* e : errorAt) {
+        if (e) {
+            cerr << "Malformed OBJ line at byte " << (e - data) << endl;
+            return false;
+        }
     }
+    return true;
+}
 
-    if (node.left >= 0)
-        hit |= traverseKd(ray, node.left, closestT);
-    if (node.right >= 0)
-        hit |= traverseKd(ray, node.right, closestT);
+enum PlyType { PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32,
+               PLY_FLOAT32, PLY_FLOAT64 };
 
-    return hit;
+struct PlyProperty {
+    string name;
+    PlyType type;        // value type, or element type for lists
+    PlyType countType;   // PLY_NONE for scalar properties
+};
+
+struct PlyElement {
+    string name;
+    size_t count;
+    vector<PlyProperty> props;
+};
+
+PlyType plyTypeFromName(const string& n) {
+    if (n == "char" || n == "int8") return PLY_INT8;
+    if (n == "uchar" || n == "uint8") return PLY_UINT8;
+    if (n == "short" || n == "int16") return PLY_INT16;
+    if (n == "ushort" || n == "uint16") return PLY_UINT16;
+    if (n == "int" || n == "int32") return PLY_INT32;
+    if (n == "uint" || n == "uint32") return PLY_UINT32;
+    if (n == "float" || n == "float32") return PLY_FLOAT32;
+    if (n == "double" || n == "float64") return PLY_FLOAT64;
+    return PLY_NONE;
 }
 
-/* ---------------- MAIN ---------------- */
+size_t plyTypeSize(PlyType t) {
+    static const size_t SIZES[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+    return SIZES[t];
+}
+
+// Reads one little-endian binary value (the host is checked to be little-endian)
+double readPlyValue(const char* p, PlyType t) {
+    switch (t) {
+    case PLY_INT8:   { int8_t v;   memcpy(&v, p, 1); return v; }
+    case PLY_UINT8:  { uint8_t v;  memcpy(&v, p, 1); return v; }
+    case PLY_INT16:  { int16_t v;  memcpy(&v, p, 2); return v; }
+    case PLY_UINT16: { uint16_t v; memcpy(&v, p, 2); return v; }
+    case PLY_INT32:  { int32_t v;  memcpy(&v, p, 4); return v; }
+    case PLY_UINT32: { uint32_t v; memcpy(&v, p, 4); return v; }
+    case PLY_FLOAT32:{ float v;    memcpy(&v, p, 4); return v; }
+    case PLY_FLOAT64:{ double v;   memcpy(&v, p, 8); return v; }
+    default: return 0;
+    }
+}
+
+// Parses the text header; body is set to the first byte after "end_header\n"
+bool parsePlyHeader(const char* data, const char* end, bool& binary, vector<PlyElement>& elements,
+                    const char*& body) {
+    const char* p = data;
+    binary = false;
+    bool sawFormat = false;
+    while (p < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!lineEnd) return false;
+        vector<string> words;
+        for (const char* q = skipBlanks(p, lineEnd); q < lineEnd; q = skipBlanks(q, lineEnd)) {
+            const char* w = skipToken(q, lineEnd);
+            words.emplace_back(q, w);
+            q = w;
+        }
+        p = lineEnd + 1;
+        if (words.empty() || words[0] == "comment" || words[0] == "obj_info" || words[0] == "ply") continue;
+        if (words[0] == "end_header") {
+            body = p;
+            return sawFormat;
+        }
+        if (words[0] == "format" && words.size() >= 2) {
+            if (words[1] == "ascii") binary = false;
+            else if (words[1] == "binary_little_endian") binary = true;
+            else return false;   // big-endian bodies are not supported
+            sawFormat = true;
+        } else if (words[0] == "element" && words.size() == 3) {
+            elements.push_back({ words[1], strtoull(words[2].c_str(), nullptr, 10), {} });
+        } else if (words[0] == "property" && !elements.empty()) {
+            if (words.size() == 3 && plyTypeFromName(words[1]) != PLY_NONE) {
+                elements.back().props.push_back({ words[2], plyTypeFromName(words[1]), PLY_NONE });
+            } else if (words.size() == 5 && words[1] == "list"
+                       && plyTypeFromName(words[2]) != PLY_NONE && plyTypeFromName(words[3]) != PLY_NONE) {
+                elements.back().props.push_back({ words[4], plyTypeFromName(words[3]), plyTypeFromName(words[2]) });
+            } else {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return false;
+}
 
-int main() {
-    gTriangles = {
-        {{-1, -1, -5}, {1, -1, -5}, {1, 1, -5}},
-        {{-1, -1, -5}, {1, 1, -5}, {-1, 1, -5}}
+int findPlyProperty(const PlyElement& e, const char* name) {
+    for (size_t i = 0; i < e.props.size(); i++)
+        if (e.props[i].name == name) return i;
+    return -1;
+}
+
+struct PlyTarget {
+    vector<float>* stream;   // null for properties that are skipped
+    int width, component;
+};
+
+// Routes vertex properties to mesh streams and sizes them. Positions are required;
+// normals (nx ny nz) and uvs (u v, s t or texture_u texture_v) are read when complete.
+// Callers check e.count against the body size first; nothing is allocated past 32-bit indices.
+bool plyVertexTargets(const PlyElement& e, IndexedMesh& mesh, vector<PlyTarget>& targets) {
+    if (e.count > UINT32_MAX) return false;
+    static const char* const POSITION[] = { "x", "y", "z" };
+    static const char* const NORMAL[] = { "nx", "ny", "nz" };
+    static const char* const UV[][2] = { { "u", "v" }, { "s", "t" }, { "texture_u", "texture_v" } };
+    targets.assign(e.props.size(), { nullptr, 0, 0 });
+    auto route = [&](vector<float>& stream, const char* const* names, int width) {
+        int props[3];
+        for (int k = 0; k < width; k++) {
+            props[k] = findPlyProperty(e, names[k]);
+            if (props[k] < 0 || e.props[props[k]].countType != PLY_NONE) return false;
+        }
+        if (e.count > SIZE_MAX / width) return false;
+        stream.resize(width * e.count);
+        for (int k = 0; k < width; k++) targets[props[k]] = { &stream, width, k };
+        return true;
     };
+    if (!route(mesh.positions, POSITION, 3)) return false;
+    route(mesh.normals, NORMAL, 3);
+    for (const auto& names : UV)
+        if (route(mesh.uvs, names, 2)) break;
+    return true;
+}
+
+bool isFaceIndexList(const PlyProperty& prop) {
+    return prop.countType != PLY_NONE && (prop.name == "vertex_indices" || prop.name == "vertex_index");
+}
+
+// Binary bodies: vertices have a fixed stride and are converted in parallel; face
+// records are variable-length lists, so they are walked once to count and once to fill.
+bool loadPLYBinary(const char* body, const char* end, const vector<PlyElement>& elements, IndexedMesh& mesh) {
+    const uint16_t probe = 1;
+    if (*reinterpret_cast<const uint8_t*>(&probe) != 1) {
+        cerr << "Binary PLY needs a little-endian host\n";
+        return false;
+    }
+    size_t numVertices = 0;
+    for (const PlyElement& e : elements)
+        if (e.name == "vertex") numVertices = e.count;
+
+    const char* p = body;
+    for (const PlyElement& e : elements) {
+        bool fixed = true;
+        size_t stride = 0;
+        for (const PlyProperty& prop : e.props) {
+            fixed = fixed && prop.countType == PLY_NONE;
+            stride += plyTypeSize(prop.type);
+        }
+
+        if (e.name == "vertex") {
+            vector<PlyTarget> targets;
+            if (!fixed || size_t(end - p) / max<size_t>(stride, 1) < e.count) return false;
+            if (!plyVertexTargets(e, mesh, targets)) return false;
+
+            struct Field { size_t offset; PlyType type; float* dst; int width; };
+            vector<Field> fields;
+            size_t offset = 0;
+            for (size_t i = 0; i < e.props.size(); i++) {
+                const PlyTarget& t = targets[i];
+                if (t.stream) fields.push_back({ offset, e.props[i].type, t.stream->data() + t.component, t.width });
+                offset += plyTypeSize(e.props[i].type);
+            }
+            size_t chunks = loaderChunkCount(e.count * stride);
+            parallelChunks(chunks, [&](size_t c) {
+                for (size_t v = e.count * c / chunks; v < e.count * (c + 1) / chunks; v++) {
+                    const char* rec = p + v * stride;
+                    for (const Field& f : fields)
+                        f.dst[f.width * v] = readPlyValue(rec + f.offset, f.type);
+                }
+            });
+            p += e.count * stride;
+            continue;
+        }
 
+        if (fixed) {
+            if (size_t(end - p) / max<size_t>(stride, 1) < e.count) return false;
+            p += e.count * stride;
+            continue;
+        }
+
+        // Walks variable-length records; onFace sees each face's index list
+        auto walk = [&](auto onFace) {
+            const char* q = p;
+            for (size_t r = 0; r < e.count; r++) {
+                for (const PlyProperty& prop : e.props) {
+                    if (prop.countType == PLY_NONE) {
+                        q += plyTypeSize(prop.type);
+                        continue;
+                    }
+                    if (end - q < (ptrdiff_t)plyTypeSize(prop.countType)) return (const char*)nullptr;
+                    double count = readPlyValue(q, prop.countType);
+                    if (count < 0) return (const char*)nullptr;
+                    size_t n = count;
+                    q += plyTypeSize(prop.countType);
+                    if (size_t(end - q) / plyTypeSize(prop.type) < n) return (const char*)nullptr;
+                    if (e.name == "face" && isFaceIndexList(prop) && !onFace(q, n, prop.type))
+                        return (const char*)nullptr;
+                    q += n * plyTypeSize(prop.type);
+                }
+                if (q > end) return (const char*)nullptr;
+            }
+            return q;
+        };
+
+        size_t numTris = 0;
+        const char* next = walk([&](const char*, size_t n, PlyType) {
+            numTris += n >= 3 ? n - 2 : 0;
+            return true;
+        });
+        if (!next) return false;
+        if (e.name == "face") {
+            mesh.indices.resize(3 * numTris);
+            uint32_t* idx = mesh.indices.data();
+            bool ok = walk([&](const char* list, size_t n, PlyType t) {
+                size_t sz = plyTypeSize(t);
+                for (size_t k = 0; k < n; k++) {
+                    double i = readPlyValue(list + k * sz, t);
+                    if (i < 0 || i >= numVertices) return false;
+                    if (k >= 2) {
+                        idx[0] = readPlyValue(list, t);
+                        idx[1] = readPlyValue(list + (k - 1) * sz, t);
+                        idx[2] = i;
+                        idx += 3;
+                    }
+                }
+                return true;
+            }) != nullptr;
+            if (!ok) return false;
+        }
+        p = next;
+    }
+    return true;
+}
+
+// ASCII bodies hold one record per line in element order. A first parallel pass
+// counts lines per chunk so every chunk knows which element its lines belong to.
+bool loadPLYAscii(const char* body, const char* end, const vector<PlyElement>& elements, IndexedMesh& mesh) {
+    size_t chunks = loaderChunkCount(end - body);
+    vector<const char*> cuts = splitLines(body, end, chunks);
+
+    vector<size_t> lineCounts(chunks, 0);
+    parallelChunks(chunks, [&](size_t c) {
+        size_t lines = 0;
+        for (const char* p = cuts[c]; p < cuts[c + 1]; p = nextLine(p, end)) lines++;
+        lineCounts[c] = lines;
+    });
+    vector<size_t> lineBase = exclusiveScan(lineCounts);
+
+    const PlyElement* vertex = nullptr;
+    const PlyElement* face = nullptr;
+    size_t vertexStart = 0, faceStart = 0, first = 0;
+    for (const PlyElement& e : elements) {
+        if (e.count > lineBase[chunks] - first) return false;   // more records than lines
+        if (e.name == "vertex") { vertex = &e; vertexStart = first; }
+        if (e.name == "face") { face = &e; faceStart = first; }
+        first += e.count;
+    }
+    vector<PlyTarget> targets;
+    if (!vertex || !plyVertexTargets(*vertex, mesh, targets)) return false;
+    size_t numVertices = vertex->count, numFaces = face ? face->count : 0;
+
+    // Visits each face's index list on the chunk's lines; onFace(corners, p) may parse from p
+    auto forEachFace = [&](size_t c, auto onFace) {
+        size_t line = lineBase[c];
+        for (const char* p = cuts[c]; p < cuts[c + 1]; p = nextLine(p, end), line++) {
+            if (line < faceStart || line >= faceStart + numFaces) continue;
+            const char* q = skipBlanks(p, end);
+            for (const PlyProperty& prop : face->props) {
+                long long n = 1;
+                if (prop.countType != PLY_NONE) {
+                    q = parseInt(q, end, n);
+                    if (!q || n < 0) return false;
+                    q = skipBlanks(q, end);
+                }
+                if (isFaceIndexList(prop)) {
+                    if (!onFace(n, q)) return false;
+                    break;
+                }
+                for (long long k = 0; k < n; k++) q = skipBlanks(skipToken(q, end), end);
+            }
+        }
+        return true;
+    };
+
+    vector<size_t> triCounts(chunks, 0);
+    vector<char> ok(chunks, 1);
+    if (face) {
+        parallelChunks(chunks, [&](size_t c) {
+            ok[c] = forEachFace(c, [&](long long n, const char*) {
+                triCounts[c] += n >= 3 ? n - 2 : 0;
+                return true;
+            });
+        });
+    }
+    vector<size_t> triBase = exclusiveScan(triCounts);
+    mesh.indices.resize(3 * triBase[chunks]);
+
+    parallelChunks(chunks, [&](size_t c) {
+        if (!ok[c]) return;
+        size_t line = lineBase[c];
+        for (const char* p = cuts[c]; p < cuts[c + 1]; p = nextLine(p, end), line++) {
+            if (line < vertexStart || line >= vertexStart + numVertices) continue;
+            size_t v = line - vertexStart;
+            const char* q = p;
+            for (const PlyTarget& t : targets) {
+                q = skipBlanks(q, end);
+                if (t.stream) {
+                    q = parseFloat(q, end, (*t.stream)[t.width * v + t.component]);
+                    if (!q) { ok[c] = 0; return; }
+                } else {
+                    q = skipToken(q, end);
+                }
+            }
+        }
+        if (!face) return;
+        uint32_t* idx = mesh.indices.data() + 3 * triBase[c];
+        ok[c] = forEachFace(c, [&](long long n, const char* q) {
+            long long firstIdx = 0, prev = 0;
+            for (long long k = 0; k < n; k++) {
+                long long i;
+                q = parseInt(skipBlanks(q, end), end, i);
+                if (!q || i < 0 || i >= (long long)numVertices) return false;
+                if (k == 0) firstIdx = i;
+                else if (k >= 2) { idx[0] = firstIdx; idx[1] = prev; idx[2] = i; idx += 3; }
+                prev = i;
+            }
+            return true;
+        });
+    });
+
+    for (char good : ok)
+        if (!good) return false;
+    return true;
+}
+
+bool loadPLY(const char* data, size_t size, IndexedMesh& mesh) {
+    const char* end = data + size;
+    bool binary;
+    vector<PlyElement> elements;
+    const char* body = nullptr;
+    if (!parsePlyHeader(data, end, binary, elements, body)) {
+        cerr << "Unsupported or malformed PLY header\n";
+        return false;
+    }
+    bool ok = binary ? loadPLYBinary(body, end, elements, mesh) : loadPLYAscii(body, end, elements, mesh);
+    if (!ok) cerr << "Malformed PLY body\n";
+    return ok;
+}
+
+// Maps the file and parses it in place; the format is chosen from the first bytes.
+// Peak memory is the output buffers plus per-chunk counters: the text is never copied.
+bool loadMesh(const char* path, IndexedMesh& mesh) {
+    auto t0 = chrono::steady_clock::now();
+    size_t size = 0;
+    shared_ptr<const char> file = mapFile(path, size);
+    error_code sizeError;
+    bool empty = !file && filesystem::is_regular_file(path, sizeError) && filesystem::file_size(path, sizeError) == 0;
+    if (!file && !empty) {
+        cerr << "Could not open mesh " << path << endl;
+        return false;
+    }
+    // mapFile refuses zero-length files; an empty file is an empty mesh
+    mesh = IndexedMesh();
+    bool ok = empty || (size >= 4 && memcmp(file.get(), "ply", 3) == 0
+                        ? loadPLY(file.get(), size, mesh)
+                        : loadOBJ(file.get(), size, mesh));
+    if (!ok) return false;
+
+    double sec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << "Loaded " << path << ": " << mesh.positions.size() / 3 << " vertices, "
+         << mesh.indices.size() / 3 << " triangles, " << size / 1e6 << " MB in "
+         << sec * 1e3 << " ms (" << size / 1e6 / sec << " MB/s)\n";
+    return true;
+}
+
+// Triangle indices [first, end), the form the kd builder takes
+vector<int> triangleRange(size_t first, size_t end) {
     vector<int> indices;
-    indices.push_back(0);
-    indices.push_back(1);
+    indices.reserve(end - first);
+    for (size_t t = first; t < end; t++) indices.push_back(t);
+    return indices;
+}
+
+/* ---------------- INSTANCING (TWO-LEVEL) ---------------- */
+
+// Row-major 3x4 affine transform: p' = m * [p, 1]
+struct Affine {
+    double m[3][4];
+};
 
-    int root = buildKdTree(indices, 0);
+Vec3 transformPoint(const Affine& a, const Vec3& p) {
+    return { a.m[0][0] * p.x + a.m[0][1] * p.y + a.m[0][2] * p.z + a.m[0][3],
+             a.m[1][0] * p.x + a.m[1][1] * p.y + a.m[1][2] * p.z + a.m[1][3],
+             a.m[2][0] * p.x + a.m[2][1] * p.y + a.m[2][2] * p.z + a.m[2][3] };
+}
+
+Vec3 transformVector(const Affine& a, const Vec3& v) {
+    return { a.m[0][0] * v.x + a.m[0][1] * v.y + a.m[0][2] * v.z,
+             a.m[1][0] * v.x + a.m[1][1] * v.y + a.m[1][2] * v.z,
+             a.m[2][0] * v.x + a.m[2][1] * v.y + a.m[2][2] * v.z };
+}
+
+// Uniform scale, then rotation about +y, then translation
+Affine makeAffine(double s, double rotY, Vec3 t) {
+    double c = cos(rotY) * s, n = sin(rotY) * s;
+    return {{ {  c, 0, n, t.x },
+              {  0, s, 0, t.y },
+              { -n, 0, c, t.z } }};
+}
+
+Affine inverseAffine(const Affine& a) {
+    const double (*m)[4] = a.m;
+    double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    double invDet = 1.0 / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+    Affine r;
+    r.m[0][0] = c00 * invDet;
+    r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+    r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+    r.m[1][0] = c01 * invDet;
+    r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+    r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+    r.m[2][0] = c02 * invDet;
+    r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+    r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+    for (int i = 0; i < 3; i++)
+        r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] + r.m[i][2] * m[2][3]);
+    return r;
+}
+
+// Bounds of a transformed box (Arvo): each output axis sums the extreme products per input axis
+AABB transformAABB(const Affine& a, const AABB& box) {
+    double lo[3], hi[3];
+    const double bmin[3] = { box.min.x, box.min.y, box.min.z };
+    const double bmax[3] = { box.max.x, box.max.y, box.max.z };
+    for (int i = 0; i < 3; i++) {
+        lo[i] = hi[i] = a.m[i][3];
+        for (int j = 0; j < 3; j++) {
+            double e = a.m[i][j] * bmin[j], f = a.m[i][j] * bmax[j];
+            lo[i] += minDouble(e, f);
+            hi[i] += maxDouble(e, f);
+        }
+    }
+    return { { lo[0], lo[1], lo[2] }, { hi[0], hi[1], hi[2] } };
+}
+
+// One placement of a bottom-level mesh. Rays are taken into object space with
+// worldToObject; the direction is not renormalized so hit distances stay in world t.
+struct Instance {
+    int mesh;
+    Affine objectToWorld;
+    Affine worldToObject;
+    AABB worldBounds;
+};
+
+vector<KdAccel> gMeshes;      // bottom level: one kd-tree per unique mesh
+vector<Instance> gInstances;
+
+void setInstanceTransform(Instance& inst, const Affine& objectToWorld) {
+    inst.objectToWorld = objectToWorld;
+    inst.worldToObject = inverseAffine(objectToWorld);
+    inst.worldBounds = transformAABB(objectToWorld, gMeshes[inst.mesh].bounds);
+}
+
+// Top level: median-split BVH over instance bounds, stored depth-first like the kd-tree
+struct TopNode {
+    AABB box;
+    int offset;   // inner: right child index, leaf: first entry in gTopInstanceIndices
+    int count;    // 0 for inner nodes
+};
+
+const int TOP_MAX_LEAF = 2;
+const int TOP_STACK_SIZE = 64;
+
+vector<TopNode> gTopNodes;
+vector<int> gTopInstanceIndices;
+int gTopDepth = 0;   // deepest leaf, bounds the traversal stack
+
+int buildTopNode(int start, int end, int depth) {
+    AABB box = { { INF, INF, INF }, { -INF, -INF, -INF } };
+    AABB centroids = box;
+    for (int i = start; i < end; i++) {
+        const AABB& b = gInstances[gTopInstanceIndices[i]].worldBounds;
+        Vec3 c = scale(add(b.min, b.max), 0.5);
+        for (int axis = 0; axis < 3; axis++) {
+            axisRef(box.min, axis) = minDouble(axisOf(box.min, axis), axisOf(b.min, axis));
+            axisRef(box.max, axis) = maxDouble(axisOf(box.max, axis), axisOf(b.max, axis));
+            axisRef(centroids.min, axis) = minDouble(axisOf(centroids.min, axis), axisOf(c, axis));
+            axisRef(centroids.max, axis) = maxDouble(axisOf(centroids.max, axis), axisOf(c, axis));
+        }
+    }
+
+    int nodeIndex = gTopNodes.size();
+    gTopNodes.push_back({ box, start, end - start });
+    gTopDepth = max(gTopDepth, depth);
+    if (end - start <= TOP_MAX_LEAF)
+        return nodeIndex;
+
+    Vec3 extent = subtract(centroids.max, centroids.min);
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int mid = (start + end) / 2;
+    nth_element(gTopInstanceIndices.begin() + start, gTopInstanceIndices.begin() + mid,
+                gTopInstanceIndices.begin() + end, [axis](int a, int b) {
+        const AABB& ba = gInstances[a].worldBounds;
+        const AABB& bb = gInstances[b].worldBounds;
+        return axisOf(ba.min, axis) + axisOf(ba.max, axis) < axisOf(bb.min, axis) + axisOf(bb.max, axis);
+    });
+
+    buildTopNode(start, mid, depth + 1); // lands at nodeIndex + 1
+    int right = buildTopNode(mid, end, depth + 1);
+    gTopNodes[nodeIndex].offset = right;
+    gTopNodes[nodeIndex].count = 0;
+    return nodeIndex;
+}
+
+// Only the top level depends on instance transforms, so moving instances costs
+// one rebuild over gInstances.size() boxes; the bottom-level kd-trees are untouched.
+void buildTopLevel() {
+    gTopNodes.clear();
+    gTopDepth = 0;
+    gTopInstanceIndices.resize(gInstances.size());
+    for (size_t i = 0; i < gInstances.size(); i++) gTopInstanceIndices[i] = i;
+    if (!gInstances.empty()) buildTopNode(0, gInstances.size(), 0);
+}
+
+struct SceneHit {
+    TriangleHit tri;   // tri.tri indexes gMesh; its vertices are in the instance's object space
+    int instance;
+};
+
+struct TopStackEntry {
+    int node;
+    double tNear;
+};
+
+// Nearer child first; deferred children are skipped once a closer hit is known.
+// hit.tri.t limits the search on entry and holds the nearest hit on return.
+bool traverseScene(const Ray& ray, SceneHit& hit) {
+    double tNear = 0.0, tFar = hit.tri.t;
+    if (gTopNodes.empty() || !rayAABB(ray, gTopNodes[0].box, tNear, tFar))
+        return false;
+
+    // At most one deferred child per level; trees deeper than the fixed stack use the heap
+    TopStackEntry fixedStack[TOP_STACK_SIZE];
+    vector<TopStackEntry> deepStack;
+    TopStackEntry* stack = fixedStack;
+    if (gTopDepth >= TOP_STACK_SIZE) {
+        deepStack.resize(gTopDepth + 1);
+        stack = deepStack.data();
+    }
+    int stackSize = 0;
+    int nodeIndex = 0;
+    bool found = false;
+
+    while (true) {
+        const TopNode& node = gTopNodes[nodeIndex];
+        if (node.count == 0) {
+            int children[2] = { nodeIndex + 1, node.offset };
+            double tChild[2];
+            bool hitChild[2];
+            for (int c = 0; c < 2; c++) {
+                tChild[c] = 0.0;
+                double tMax = hit.tri.t;
+                hitChild[c] = rayAABB(ray, gTopNodes[children[c]].box, tChild[c], tMax);
+            }
+            if (hitChild[0] && hitChild[1]) {
+                int nearC = tChild[0] <= tChild[1] ? 0 : 1;
+                stack[stackSize++] = { children[1 - nearC], tChild[1 - nearC] };
+                nodeIndex = children[nearC];
+                continue;
+            }
+            if (hitChild[0] || hitChild[1]) {
+                nodeIndex = children[hitChild[0] ? 0 : 1];
+                continue;
+            }
+        } else {
+            for (int i = node.offset; i < node.offset + node.count; i++) {
+                const Instance& inst = gInstances[gTopInstanceIndices[i]];
+                Ray local;
+                local.origin = transformPoint(inst.worldToObject, ray.origin);
+                local.dir = transformVector(inst.worldToObject, ray.dir);
+                if (traverseKd(gMeshes[inst.mesh], local, hit.tri)) {
+                    hit.instance = gTopInstanceIndices[i];
+                    found = true;
+                }
+            }
+        }
+
+        do {
+            if (stackSize == 0) return found;
+            TopStackEntry e = stack[--stackSize];
+            nodeIndex = e.node;
+            tNear = e.tNear;
+        } while (tNear > hit.tri.t);
+    }
+}
+
+/* ---------------- MAIN ---------------- */
+
+// Appends a seg x seg unit-sphere tessellation to mesh, sharing vertices between
+// neighbouring triangles. Normals and uvs are added when the mesh carries those
+// streams for every vertex (or is empty). Returns the new triangle indices.
+vector<int> appendSphereMesh(IndexedMesh& mesh, int seg, Vec3 center) {
+    size_t firstTri = mesh.triangleCount();
+    uint32_t base = mesh.vertexCount();
+    bool withNormals = mesh.normals.size() == 3 * size_t(base);
+    bool withUVs = mesh.uvs.size() == 2 * size_t(base);
+    for (int i = 0; i <= seg; i++) {
+        for (int j = 0; j <= seg; j++) {
+            double th = M_PI * i / seg, ph = 2 * M_PI * j / seg;
+            Vec3 n = { sin(th) * cos(ph), cos(th), sin(th) * sin(ph) };
+            addVertex(mesh, add(n, center));
+            if (withNormals) mesh.normals.insert(mesh.normals.end(), { float(n.x), float(n.y), float(n.z) });
+            if (withUVs) mesh.uvs.insert(mesh.uvs.end(), { float(j) / seg, float(i) / seg });
+        }
+    }
+    auto V = [&](int i, int j) { return base + i * (seg + 1) + j; };
+    for (int i = 0; i < seg; i++) {
+        for (int j = 0; j < seg; j++) {
+            addTriangle(mesh, V(i, j), V(i + 1, j), V(i + 1, j + 1));
+            addTriangle(mesh, V(i, j), V(i + 1, j + 1), V(i, j + 1));
+        }
+    }
+    return triangleRange(firstTri, mesh.triangleCount());
+}
+
+// Compares the 8-wide kernel with the scalar double-precision Möller–Trumbore over every
+// triangle of accel, for rays from eye toward random points in its bounds. Returns the
+// number of rays where hit/miss differs or t differs by more than the float tolerance.
+int checkTriangleKernel(const KdAccel& accel, Vec3 eye, int rayCount) {
+    KdView view = accel.view();
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    auto next = [&state]() {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (state >> 11) * (1.0 / 9007199254740992.0);
+    };
+    Vec3 extent = subtract(accel.bounds.max, accel.bounds.min);
+
+    int differing = 0;
+    double maxError = 0.0;
+    for (int r = 0; r < rayCount; r++) {
+        Vec3 target = { accel.bounds.min.x + next() * extent.x, accel.bounds.min.y + next() * extent.y,
+                        accel.bounds.min.z + next() * extent.z };
+        Ray ray;
+        ray.origin = eye;
+        ray.dir = subtract(target, eye);
+
+        TriangleHit kernel = { INF, -1, 0, 0 };
+        intersectTriangles8(view, ray, 0, view.triCount, kernel);
+
+        double reference = INF;
+        for (size_t i = 0; i < view.triCount; i++) {
+            double t;
+            if (rayTriangleIntersect(ray, gMesh, view.triIndices[i], t) && t < reference) reference = t;
+        }
+
+        bool kernelHit = kernel.tri >= 0, referenceHit = reference < INF;
+        if (kernelHit != referenceHit) {
+            differing++;
+        } else if (kernelHit) {
+            double error = fabs(kernel.t - reference) / reference;
+            maxError = maxDouble(maxError, error);
+            if (error > 1e-4) differing++;
+        }
+    }
+    cout << "Triangle kernel vs scalar Möller–Trumbore: " << rayCount << " rays, " << differing
+         << " differing results, max relative t error " << maxError << "\n";
+    return differing;
+}
+
+// Compares traverseScene with brute force over every triangle of every instance whose world
+// bounds the ray crosses, for random primary rays from the origin. Returns the number of rays
+// where hit/miss or the hit instance differs, or t differs by more than the float tolerance.
+int checkInstancedScene(int rayCount) {
+    // Each mesh's triangles, without the duplicates kd leaves introduce
+    vector<vector<int>> meshTriangles(gMeshes.size());
+    for (size_t m = 0; m < gMeshes.size(); m++) {
+        KdView view = gMeshes[m].view();
+        meshTriangles[m].assign(view.triIndices, view.triIndices + view.triCount);
+        sort(meshTriangles[m].begin(), meshTriangles[m].end());
+        meshTriangles[m].erase(unique(meshTriangles[m].begin(), meshTriangles[m].end()), meshTriangles[m].end());
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    auto next = [&state]() {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (state >> 11) * (1.0 / 9007199254740992.0);
+    };
+
+    int differing = 0;
+    double maxError = 0.0;
+    for (int r = 0; r < rayCount; r++) {
+        Ray ray;
+        ray.origin = {0, 0, 0};
+        ray.dir = {next() - 0.5, next() - 0.5, -1};
+
+        SceneHit scene = { { INF, -1, 0, 0 }, -1 };
+        traverseScene(ray, scene);
+
+        double reference = INF;
+        int referenceInstance = -1;
+        for (size_t i = 0; i < gInstances.size(); i++) {
+            const Instance& inst = gInstances[i];
+            double tNear = 0.0, tFar = reference;
+            if (!rayAABB(ray, inst.worldBounds, tNear, tFar)) continue;
+            Ray local;
+            local.origin = transformPoint(inst.worldToObject, ray.origin);
+            local.dir = transformVector(inst.worldToObject, ray.dir);
+            for (int tri : meshTriangles[inst.mesh]) {
+                double t;
+                if (rayTriangleIntersect(local, gMesh, tri, t) && t < reference) {
+                    reference = t;
+                    referenceInstance = i;
+                }
+            }
+        }
+
+        bool sceneHit = scene.instance >= 0, referenceHit = referenceInstance >= 0;
+        if (sceneHit != referenceHit) {
+            differing++;
+        } else if (sceneHit) {
+            double error = fabs(scene.tri.t - reference) / reference;
+            maxError = maxDouble(maxError, error);
+            if (error > 1e-4 || scene.instance != referenceInstance) differing++;
+        }
+    }
+    cout << "  traversal vs brute force over all instances: " << rayCount << " rays, " << differing
+         << " differing results, max relative t error " << maxError << "\n";
+    return differing;
+}
+
+// Per-user cache file for the built-in mesh: $XDG_CACHE_HOME/kd_tree_pro, else
+// ~/.cache/kd_tree_pro. Empty when neither exists, which turns caching off.
+string userCachePath(const char* name) {
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    filesystem::path dir;
+    if (xdg && *xdg) dir = xdg;
+    else if (home && *home) dir = filesystem::path(home) / ".cache";
+    else return "";
+    dir /= "kd_tree_pro";
+    error_code ec;
+    filesystem::create_directories(dir, ec);
+    if (ec) return "";
+    return (dir / name).string();
+}
+
+int main(int argc, char** argv) {
+    addVertex(gMesh, {-1, -1, -5});
+    addVertex(gMesh, {1, -1, -5});
+    addVertex(gMesh, {1, 1, -5});
+    addVertex(gMesh, {-1, 1, -5});
+    addTriangle(gMesh, 0, 1, 2);
+    addTriangle(gMesh, 0, 2, 3);
+
+    vector<int> indices = triangleRange(0, gMesh.triangleCount());
+
+    buildKdTree(gKd, indices);
 
     Ray ray;
     ray.origin = {0, 0, 0};
     ray.dir = {0, 0, -1};
 
     double closestT = INF;
-    bool hit = traverseKd(ray, root, closestT);
+    bool hit = traverseKd(gKd, ray, closestT);
 
     if (hit)
         cout << "Ray HIT geometry at t = " << closestT << endl;
     else
         cout << "Ray MISSED geometry\n";
 
+    // A mesh file (OBJ or PLY) given on the command line replaces the tessellated sphere
+    gMesh = IndexedMesh();
+    // The built-in mesh caches in the per-user cache directory, a loaded mesh next to its file
+    string cachePath = userCachePath("sphere.kdcache");
+    Vec3 eye = {0, 0, 0};
+    if (argc > 1) {
+        if (!loadMesh(argv[1], gMesh)) return 1;
+        indices = triangleRange(0, gMesh.triangleCount());
+        cachePath = string(argv[1]) + ".kdcache";
+
+        // Back the camera off along +z until the mesh fills the view
+        AABB b = computeAABB(indices);
+        Vec3 extent = subtract(b.max, b.min);
+        eye = { (b.min.x + b.max.x) / 2, (b.min.y + b.max.y) / 2,
+                b.max.z + 1.2 * maxDouble(extent.x, extent.y) };
+        ray.origin = eye;
+    } else {
+        indices = appendSphereMesh(gMesh, 512, {0, 0, -5});
+    }
+
+    auto t0 = chrono::steady_clock::now();
+    bool cached = loadOrBuildKdTree(gKd, indices, cachePath.c_str());
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    size_t nodeCount = gKd.view().nodeCount;
+    cout << (cached ? "Mapped cached" : "Built") << " kd-tree over " << gMesh.triangleCount() << " triangles: "
+         << nodeCount << " nodes (" << nodeCount * sizeof(KdNode) / 1024 << " KiB) in "
+         << ms << " ms\n";
+    const char* streams = gMesh.normals.empty() ? (gMesh.uvs.empty() ? "" : " with uvs")
+                        : (gMesh.uvs.empty() ? " with normals" : " with normals and uvs");
+    cout << "Indexed mesh" << streams << ": " << gMesh.bytes() / 1024 << " KiB for " << gMesh.vertexCount()
+         << " vertices, vs " << gMesh.triangleCount() * sizeof(Triangle) / 1024 << " KiB as Triangle\n";
+
+    TriangleHit meshHit = { INF, -1, 0, 0 };
+    if (traverseKd(gKd, ray, meshHit)) {
+        Vec3 n = interpolateNormal(gMesh, meshHit);
+        float us, vs;
+        interpolateUV(gMesh, meshHit, us, vs);
+        cout << "Mesh hit at t = " << meshHit.t << ", normal (" << n.x << ", " << n.y << ", " << n.z
+             << "), uv (" << us << ", " << vs << ")\n";
+    }
+    if (checkTriangleKernel(gKd, eye, 64) > 0) return 1;
+
+    const int W = 256, H = 256;
+    gKdNodeVisits = 0;
+    t0 = chrono::steady_clock::now();
+    for (int y = 0; y < H; y++) {
+        for (int x = 0; x < W; x++) {
+            Ray primary;
+            primary.origin = eye;
+            primary.dir = {(x + 0.5) / W - 0.5, (y + 0.5) / H - 0.5, -1};
+            double t = INF;
+            traverseKd(gKd, primary, t);
+        }
+    }
+    double sec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << "Kd node visits per ray: " << double(gKdNodeVisits) / (W * H)
+         << ", " << W * H / sec / 1e6 << " Mrays/s\n";
+
+    // Instanced field: one 8K-triangle mesh placed 10,000 times
+    const int GRID = 100;
+    gMesh = IndexedMesh();
+    gMeshes.assign(1, KdAccel());
+    buildKdTree(gMeshes[0], appendSphereMesh(gMesh, 64, {0, 0, 0}));
+
+    gInstances.clear();
+    for (int gz = 0; gz < GRID; gz++) {
+        for (int gx = 0; gx < GRID; gx++) {
+            Instance inst;
+            inst.mesh = 0;
+            gInstances.push_back(inst);
+            setInstanceTransform(gInstances.back(),
+                makeAffine(0.4, 0.1 * (gx + gz), {gx - GRID / 2.0, -2, -3.0 - gz}));
+        }
+    }
+    t0 = chrono::steady_clock::now();
+    buildTopLevel();
+    ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+    const KdAccel& mesh = gMeshes[0];
+    size_t meshBytes = gMesh.bytes() + mesh.nodes.size() * sizeof(KdNode)
+                     + mesh.triIndices.size() * sizeof(int) + mesh.soa.data.size() * sizeof(float);
+    size_t instanceBytes = gInstances.size() * sizeof(Instance) + gTopNodes.size() * sizeof(TopNode)
+                         + gTopInstanceIndices.size() * sizeof(int);
+    cout << "Instanced scene: " << gInstances.size() << " instances of " << gMesh.triangleCount()
+         << " triangles (" << gInstances.size() * gMesh.triangleCount() << " effective)\n"
+         << "  mesh " << meshBytes / 1024 << " KiB + instances " << instanceBytes / 1024
+         << " KiB vs ~" << meshBytes * gInstances.size() / (1024 * 1024) << " MiB flattened\n"
+         << "  top level built in " << ms << " ms\n";
+
+    auto renderInstanced = [&]() {
+        long long hits = 0;
+        gKdNodeVisits = 0;
+        auto start = chrono::steady_clock::now();
+        for (int y = 0; y < H; y++) {
+            for (int x = 0; x < W; x++) {
+                Ray primary;
+                primary.origin = {0, 0, 0};
+                primary.dir = {(x + 0.5) / W - 0.5, (y + 0.5) / H - 0.5, -1};
+                SceneHit sh = { { INF, -1, 0, 0 }, -1 };
+                hits += traverseScene(primary, sh);
+            }
+        }
+        double s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "  " << hits << " hits, kd node visits per ray: " << double(gKdNodeVisits) / (W * H)
+             << ", " << W * H / s / 1e6 << " Mrays/s\n";
+    };
+    renderInstanced();
+    if (checkInstancedScene(2000) > 0) return 1;
+
+    // Moving an instance only touches its transform and the top level
+    t0 = chrono::steady_clock::now();
+    setInstanceTransform(gInstances[GRID / 2], makeAffine(1.5, 0.0, {0, 0, -4}));
+    buildTopLevel();
+    ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    cout << "  moved one instance, top level rebuilt in " << ms << " ms\n";
+    renderInstanced();
+
     return 0;
 }
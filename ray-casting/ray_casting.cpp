@@ -1,6 +1,20 @@
 #include <cmath>      // for sqrt()
 #include <fstream>   // for file output
 #include <iostream>  // for console output
+#include <vector>    // for the framebuffer and tile lists
+#include <string>    // for command-line parsing
+#include <cstdlib>   // for atoi()
+#include <chrono>    // for timing the render
+#include <thread>    // for worker threads
+#include <mutex>     // for tile queue locks
+#include <deque>     // for per-thread tile queues
+#include <condition_variable>  // for the writer thread
+#include <cstring>   // for memcpy()
+#if defined(__unix__)
+#include <fcntl.h>     // for open()
+#include <sys/mman.h>  // for mmap()
+#include <unistd.h>    // for ftruncate(), close()
+#endif
 using namespace std;
 /* =======================
    3D Vector structure
@@ -79,10 +93,260 @@ bool intersectSphere(Ray ray, Sphere sphere, float &t) {
     return t > 0;
 }
 
+/* =======================
+   Tile scheduler (work stealing)
+   ======================= */
+/* Rectangle of pixels [x0, x1) x [y0, y1), rows counted from the top */
+struct Tile { int x0, y0, x1, y1; };
+
+/* Per-thread scratch state, reused across all tiles a worker renders.
+   Cache-line aligned so workers bumping their counters do not false-share. */
+struct alignas(64) ThreadScratch {
+    long long rays = 0;
+};
+
+/* Each worker pops from the back of its own queue and steals from the front of others */
+struct TileQueue {
+    mutex lock;
+    deque<int> tiles;
+};
+
+/* Render every tile exactly once across threadCount workers.
+   Output is deterministic as long as renderTile only writes its own pixels. */
+template <typename RenderTile>
+void renderTiles(int width, int height, int tileSize, int threadCount,
+                 vector<ThreadScratch>& scratch, RenderTile renderTile) {
+    vector<Tile> tiles;
+    for (int y = 0; y < height; y += tileSize)
+        for (int x = 0; x < width; x += tileSize)
+            tiles.push_back({x, y, min(x + tileSize, width), min(y + tileSize, height)});
+
+    vector<TileQueue> queues(threadCount);
+    for (size_t i = 0; i < tiles.size(); i++)
+        queues[i * threadCount / tiles.size()].tiles.push_back(i);
+    scratch.assign(threadCount, ThreadScratch());
+
+    auto worker = [&](int id) {
+        while (true) {
+            int tile = -1;
+            {
+                lock_guard<mutex> g(queues[id].lock);
+                if (!queues[id].tiles.empty()) {
+                    tile = queues[id].tiles.back();
+                    queues[id].tiles.pop_back();
+                }
+            }
+            for (int k = 1; tile < 0 && k < threadCount; k++) {
+                TileQueue& victim = queues[(id + k) % threadCount];
+                lock_guard<mutex> g(victim.lock);
+                if (!victim.tiles.empty()) {
+                    tile = victim.tiles.front();
+                    victim.tiles.pop_front();
+                }
+            }
+            // No tiles are added after startup, so empty queues everywhere means done
+            if (tile < 0) return;
+            renderTile(tiles[tile], scratch[id]);
+        }
+    };
+
+    vector<thread> pool;
+    for (int id = 1; id < threadCount; id++) pool.emplace_back(worker, id);
+    worker(0);
+    for (thread& t : pool) t.join();
+}
+
+/* =======================
+   Image output
+   ======================= */
+enum ImageFormat { FORMAT_P6, FORMAT_PFM };
+
+struct OutputOptions {
+    ImageFormat format = FORMAT_P6;
+    float gamma = 1.0f;     // 1.0 keeps the linear values as they are
+    bool useMmap = false;   // write through a memory-mapped file
+};
+
+/* Clamp to [0,1], apply 1/gamma and quantize to 8 bits.
+   The loop is branch-free so the compiler can vectorize it. */
+void quantize(const float* src, unsigned char* dst, size_t n, float gamma) {
+    if (gamma == 1.0f) {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = (unsigned char)(min(max(src[i], 0.0f), 1.0f) * 255.0f);
+    } else {
+        float invGamma = 1.0f / gamma;
+        for (size_t i = 0; i < n; i++)
+            dst[i] = (unsigned char)(powf(min(max(src[i], 0.0f), 1.0f), invGamma) * 255.0f);
+    }
+}
+
+/* PFM records the float byte order in the sign of its scale: negative for little-endian */
+bool hostIsLittleEndian() {
+    uint16_t probe = 1;
+    unsigned char first;
+    memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+string imageHeader(int width, int height, const OutputOptions& opts) {
+    if (opts.format == FORMAT_PFM)
+        return "PF\n" + to_string(width) + " " + to_string(height) +
+               (hostIsLittleEndian() ? "\n-1.0\n" : "\n1.0\n");
+    return "P6\n" + to_string(width) + " " + to_string(height) + "\n255\n";
+}
+
+size_t imageSize(int width, int height, const OutputOptions& opts) {
+    size_t pixels = size_t(width) * height * 3;
+    return imageHeader(width, height, opts).size() +
+           pixels * (opts.format == FORMAT_PFM ? sizeof(float) : 1);
+}
+
+/* Encodes a top-to-bottom framebuffer into out, which must hold imageSize() bytes.
+   PFM stores host-order floats with rows bottom to top. */
+void encodeImage(const vector<Vec3>& framebuffer, int width, int height,
+                 const OutputOptions& opts, unsigned char* out) {
+    string header = imageHeader(width, height, opts);
+    memcpy(out, header.data(), header.size());
+    out += header.size();
+
+    const float* pixels = &framebuffer[0].x;
+    size_t rowFloats = size_t(width) * 3;
+    if (opts.format == FORMAT_PFM) {
+        for (int row = 0; row < height; row++)
+            memcpy(out + row * rowFloats * sizeof(float),
+                   pixels + (height - 1 - row) * rowFloats, rowFloats * sizeof(float));
+    } else {
+        quantize(pixels, out, rowFloats * height, opts.gamma);
+    }
+}
+
+bool writeImage(const string& path, const vector<Vec3>& framebuffer, int width, int height,
+                const OutputOptions& opts) {
+    size_t size = imageSize(width, height, opts);
+#if defined(__unix__)
+    if (opts.useMmap) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        if (ftruncate(fd, size) != 0) { close(fd); return false; }
+        void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return false;
+        encodeImage(framebuffer, width, height, opts, (unsigned char*)map);
+        return munmap(map, size) == 0;
+    }
+#endif
+    vector<unsigned char> bytes(size);
+    encodeImage(framebuffer, width, height, opts, bytes.data());
+    ofstream file(path, ios::binary);
+    file.write((const char*)bytes.data(), bytes.size());
+    return bool(file);
+}
+
+/* Encodes and writes frames on a background thread so output overlaps rendering */
+class AsyncImageWriter {
+public:
+    AsyncImageWriter() : worker(&AsyncImageWriter::run, this) {}
+
+    struct Result {
+        string path;
+        bool ok;
+    };
+
+    ~AsyncImageWriter() { finish(); }
+
+    /* Waits for every submitted frame; the caller reports the results, so only the
+       calling thread writes to cout */
+    vector<Result> finish() {
+        {
+            lock_guard<mutex> g(lock);
+            done = true;
+        }
+        wake.notify_one();
+        if (worker.joinable()) worker.join();
+        return move(results);
+    }
+
+    /* Takes ownership of the framebuffer; the caller can start the next frame immediately */
+    void submit(const string& path, vector<Vec3>&& framebuffer, int width, int height,
+                const OutputOptions& opts) {
+        {
+            lock_guard<mutex> g(lock);
+            jobs.push_back({path, move(framebuffer), width, height, opts});
+        }
+        wake.notify_one();
+    }
+
+private:
+    struct Job {
+        string path;
+        vector<Vec3> framebuffer;
+        int width, height;
+        OutputOptions opts;
+    };
+
+    void run() {
+        while (true) {
+            Job job;
+            {
+                unique_lock<mutex> g(lock);
+                wake.wait(g, [&]{ return done || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = move(jobs.front());
+                jobs.pop_front();
+            }
+            bool ok = writeImage(job.path, job.framebuffer, job.width, job.height, job.opts);
+            lock_guard<mutex> g(lock);
+            results.push_back({job.path, ok});
+        }
+    }
+
+    mutex lock;
+    condition_variable wake;
+    deque<Job> jobs;
+    vector<Result> results;
+    bool done = false;
+    thread worker;
+};
+
+/* Value following name on the command line, or nullptr */
+const char* findArg(int argc, char** argv, const char* name) {
+    for (int i = 1; i + 1 < argc; i++)
+        if (string(argv[i]) == name) return argv[i + 1];
+    return nullptr;
+}
+
+bool hasFlag(int argc, char** argv, const char* name) {
+    for (int i = 1; i < argc; i++)
+        if (string(argv[i]) == name) return true;
+    return false;
+}
+
+/* --format p6|pfm, --gamma G and --mmap; false after reporting an unknown format */
+bool parseOutput(int argc, char** argv, OutputOptions& opts) {
+    const char* format = findArg(argc, argv, "--format");
+    if (format && string(format) == "pfm") {
+        opts.format = FORMAT_PFM;
+    } else if (format && string(format) != "p6") {
+        cerr << "Unknown --format " << format << " (expected p6 or pfm)\n";
+        return false;
+    }
+    const char* gamma = findArg(argc, argv, "--gamma");
+    if (gamma) opts.gamma = max(0.01f, float(atof(gamma)));
+    opts.useMmap = hasFlag(argc, argv, "--mmap");
+    return true;
+}
+
+/* Read "--threads N" from the command line, defaulting to all cores */
+int parseThreads(int argc, char** argv) {
+    const char* threads = findArg(argc, argv, "--threads");
+    if (threads) return max(1, atoi(threads));
+    return max(1u, thread::hardware_concurrency());
+}
+
 /* =======================
    Main function
    ======================= */
-int main() {
+int main(int argc, char** argv) {
 
     // Image resolution
     const int WIDTH = 400;
@@ -98,52 +362,88 @@ int main() {
         {1, 0, 0}     // color (red)
     };
 
-    // Open PPM image file
-    ofstream image("ray_casting.ppm");
-    image << "P3\n" << WIDTH << " " << HEIGHT << "\n255\n";
+    // Tile size and worker count
+    const int TILE = 16;
+    int threads = parseThreads(argc, argv);
+
+    // Output format and background writer
+    OutputOptions output;
+    if (!parseOutput(argc, argv, output)) return 1;
+    AsyncImageWriter writer;
 
-    // Loop over every pixel
-    for (int y = HEIGHT - 1; y >= 0; y--) {
-        for (int x = 0; x < WIDTH; x++) {
+    // Framebuffer rows are stored top to bottom, matching the file order
+    vector<Vec3> framebuffer(WIDTH * HEIGHT);
+    vector<ThreadScratch> scratch;
 
-            // Convert pixel position to viewport coordinates
-            float u = (x + 0.5f) / WIDTH - 0.5f;
-            float v = (y + 0.5f) / HEIGHT - 0.5f;
+    auto start = chrono::steady_clock::now();
 
-            // Ray direction through pixel
-            Vec3 direction = normalize({u, v, -1});
+    // Render tiles in parallel
+    renderTiles(WIDTH, HEIGHT, TILE, threads, scratch,
+                [&](const Tile& tile, ThreadScratch& local) {
+        for (int row = tile.y0; row < tile.y1; row++) {
+            int y = HEIGHT - 1 - row;
+            for (int x = tile.x0; x < tile.x1; x++) {
 
-            // Create ray
-            Ray ray = {camera, direction};
+                // Convert pixel position to viewport coordinates
+                float u = (x + 0.5f) / WIDTH - 0.5f;
+                float v = (y + 0.5f) / HEIGHT - 0.5f;
 
-            // Default background color
-            Vec3 color = {0.2f, 0.3f, 0.5f};
+                // Ray direction through pixel
+                Vec3 direction = normalize({u, v, -1});
 
-            float t;
+                // Create ray
+                Ray ray = {camera, direction};
+                local.rays++;
 
-            // Check intersection with sphere
-            if (intersectSphere(ray, sphere, t)) {
+                // Default background color
+                Vec3 color = {0.2f, 0.3f, 0.5f};
 
-                // Compute hit point
-                Vec3 hitPoint = add(ray.origin,
-                                    multiply(ray.direction, t));
+                float t;
 
-                // Compute surface normal
-                Vec3 normal = normalize(
-                    subtract(hitPoint, sphere.center)
-                );
+                // Check intersection with sphere
+                if (intersectSphere(ray, sphere, t)) {
 
-                // Convert normal to color
-                color = multiply(add(normal, {1,1,1}), 0.5f);
+                    // Compute hit point
+                    Vec3 hitPoint = add(ray.origin,
+                                        multiply(ray.direction, t));
+
+                    // Compute surface normal
+                    Vec3 normal = normalize(
+                        subtract(hitPoint, sphere.center)
+                    );
+
+                    // Convert normal to color
+                    color = multiply(add(normal, {1,1,1}), 0.5f);
+                }
+
+                // Store pixel color
+                framebuffer[row * WIDTH + x] = color;
             }
+        }
+    });
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-            // Write pixel color to image
-            image << int(color.x * 255) << " "
-                  << int(color.y * 255) << " "
-                  << int(color.z * 255) << "\n";
+    // Total rays traced by all threads
+    long long rays = 0;
+    for (const ThreadScratch& t : scratch) rays += t.rays;
+
+    // Hand the frame to the writer thread
+    writer.submit(output.format == FORMAT_PFM ? "ray_casting.pfm" : "ray_casting.ppm",
+                  move(framebuffer), WIDTH, HEIGHT, output);
+
+    cout << "Rendered " << WIDTH << "x" << HEIGHT << " ("
+         << threads << " threads, " << rays / seconds / 1e6 << " Mrays/s)\n";
+
+    // Written files are reported here, after the writer thread has finished
+    int status = 0;
+    for (const AsyncImageWriter::Result& r : writer.finish()) {
+        if (r.ok) {
+            cout << r.path << " generated successfully\n";
+        } else {
+            cout << "failed to write " << r.path << "\n";
+            status = 1;
         }
     }
-
-    image.close();
-    cout << "ray_casting.ppm generated successfully\n";
+    return status;
 }
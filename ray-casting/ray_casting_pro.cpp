@@ -2,6 +2,24 @@
 #include <fstream>
 #include <vector>
 #include <iostream>
+#include <string>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <condition_variable>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 /* =======================
@@ -21,6 +39,11 @@ Vec3 multiply(Vec3 v, float s) {
     return {v.x*s, v.y*s, v.z*s};
 }
 
+// Component-wise product (color times color)
+Vec3 multiply(Vec3 a, Vec3 b) {
+    return {a.x*b.x, a.y*b.y, a.z*b.z};
+}
+
 float dot(Vec3 a, Vec3 b) {
     return a.x*b.x + a.y*b.y + a.z*b.z;
 }
@@ -35,80 +58,968 @@ Vec3 normalize(Vec3 v) {
    ======================= */
 struct Ray { Vec3 origin, direction; };
 
+/* =======================
+   Lights and light BVH
+   ======================= */
+// Isotropic point light; intensity falls off as 1/d^2
+struct PointLight {
+    Vec3 position;
+    Vec3 intensity;
+};
+
+const int LIGHT_WIDTH = 8;
+
+// Light tree node with up to 8 children stored as SoA lanes, so one AVX pass scores
+// them all. Point lights emit in every direction, so a child bounds position and power only.
+struct alignas(32) LightNode {
+    float cx[LIGHT_WIDTH], cy[LIGHT_WIDTH], cz[LIGHT_WIDTH];  // child bounding sphere centers
+    float radius[LIGHT_WIDTH];   // child bounding sphere radii, 0 for a single light
+    float power[LIGHT_WIDTH];    // summed mean intensity below the child, 0 for unused lanes
+    int child[LIGHT_WIDTH];      // inner child node index, or -1 for a single light
+    int first[LIGHT_WIDTH];      // first light below the child in LightTree::lights
+    int count;                   // children in use
+};
+
+struct LightTree {
+    vector<PointLight> lights;  // reordered so that every child covers a contiguous range
+    vector<LightNode> nodes;
+};
+
+float lightPower(const PointLight& l) {
+    return (l.intensity.x + l.intensity.y + l.intensity.z) / 3;
+}
+
+// Bounds of lights [first, first+count)
+void boundLights(const LightTree& tree, int first, int count, Vec3& lo, Vec3& hi) {
+    lo = hi = tree.lights[first].position;
+    for(int i=first; i<first+count; i++) {
+        Vec3 p = tree.lights[i].position;
+        lo = {min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z)};
+        hi = {max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z)};
+    }
+}
+
+// Cuts lights [first, first+count) into up to 2^levels ranges by median splits on the
+// longest axis, the binary tree a node's children would have had
+void splitLights(LightTree& tree, int first, int count, int levels, vector<pair<int,int>>& ranges) {
+    if(levels == 0 || count == 1) {
+        ranges.push_back({first, count});
+        return;
+    }
+    Vec3 lo, hi;
+    boundLights(tree, first, count, lo, hi);
+    Vec3 extent = subtract(hi, lo);
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int half = count / 2;
+    auto begin = tree.lights.begin() + first;
+    nth_element(begin, begin + half, begin + count, [axis](const PointLight& a, const PointLight& b) {
+        return (&a.position.x)[axis] < (&b.position.x)[axis];
+    });
+    splitLights(tree, first, half, levels - 1, ranges);
+    splitLights(tree, first + half, count - half, levels - 1, ranges);
+}
+
+int buildLightNode(LightTree& tree, int first, int count) {
+    int index = tree.nodes.size();
+    tree.nodes.push_back(LightNode());
+
+    vector<pair<int,int>> ranges;
+    splitLights(tree, first, count, 3, ranges);
+
+    LightNode node = {};
+    node.count = ranges.size();
+    for(int k=0; k<node.count; k++) {
+        int rFirst = ranges[k].first, rCount = ranges[k].second;
+        Vec3 lo, hi;
+        boundLights(tree, rFirst, rCount, lo, hi);
+        Vec3 extent = subtract(hi, lo);
+        node.cx[k] = 0.5f * (lo.x + hi.x);
+        node.cy[k] = 0.5f * (lo.y + hi.y);
+        node.cz[k] = 0.5f * (lo.z + hi.z);
+        node.radius[k] = rCount > 1 ? 0.5f * sqrt(dot(extent, extent)) : 0.0f;
+        for(int i=rFirst; i<rFirst+rCount; i++) node.power[k] += lightPower(tree.lights[i]);
+        node.first[k] = rFirst;
+        node.child[k] = rCount > 1 ? buildLightNode(tree, rFirst, rCount) : -1;
+    }
+    tree.nodes[index] = node;
+    return index;
+}
+
+LightTree buildLightTree(const vector<PointLight>& lights) {
+    LightTree tree;
+    tree.lights = lights;
+    if(!lights.empty()) buildLightNode(tree, 0, lights.size());
+    return tree;
+}
+
+// Upper estimate of what the lights under child k deliver to a surface at P facing N:
+// power times the largest cosine between N and a direction into the child's bounding
+// sphere, over the squared distance to its center. Zero only when the whole sphere is
+// behind the surface. With a = N.(center - P) and d, r the distance and radius, the
+// cosine of (angle to the center - sphere half-angle) is (a sqrt(d^2-r^2) + r sqrt(d^2-a^2)) / d^2.
+#if defined(__AVX__)
+static inline __m256 childImportance8(const LightNode& node, Vec3 P, Vec3 N) {
+    __m256 tx = _mm256_sub_ps(_mm256_load_ps(node.cx), _mm256_set1_ps(P.x));
+    __m256 ty = _mm256_sub_ps(_mm256_load_ps(node.cy), _mm256_set1_ps(P.y));
+    __m256 tz = _mm256_sub_ps(_mm256_load_ps(node.cz), _mm256_set1_ps(P.z));
+    __m256 r = _mm256_load_ps(node.radius), power = _mm256_load_ps(node.power);
+    __m256 zero = _mm256_setzero_ps();
+
+    __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, tx), _mm256_mul_ps(ty, ty)), _mm256_mul_ps(tz, tz));
+    __m256 r2 = _mm256_mul_ps(r, r);
+    __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, _mm256_set1_ps(N.x)), _mm256_mul_ps(ty, _mm256_set1_ps(N.y))),
+                             _mm256_mul_ps(tz, _mm256_set1_ps(N.z)));
+    __m256 tangent = _mm256_sqrt_ps(_mm256_max_ps(_mm256_sub_ps(d2, r2), zero));
+    __m256 cosD2 = _mm256_add_ps(_mm256_mul_ps(a, tangent),
+                                 _mm256_mul_ps(r, _mm256_sqrt_ps(_mm256_max_ps(_mm256_sub_ps(d2, _mm256_mul_ps(a, a)), zero))));
+    cosD2 = _mm256_max_ps(cosD2, zero);
+
+    // Outside the sphere: power * cos / d^2, with cos = 1 once N points into its cone;
+    // inside it: power / r^2
+    __m256 front = _mm256_cmp_ps(a, tangent, _CMP_GE_OQ);
+    __m256 inside = _mm256_cmp_ps(d2, r2, _CMP_LE_OQ);
+    __m256 num = _mm256_mul_ps(power, _mm256_blendv_ps(cosD2, d2, front));
+    __m256 den = _mm256_mul_ps(d2, d2);
+    num = _mm256_blendv_ps(num, power, inside);
+    den = _mm256_blendv_ps(den, _mm256_max_ps(r2, _mm256_set1_ps(1e-6f)), inside);
+    return _mm256_div_ps(num, den);
+}
+#endif
+
+void childImportance(const LightNode& node, Vec3 P, Vec3 N, float* weights) {
+#if defined(__AVX__)
+    _mm256_storeu_ps(weights, childImportance8(node, P, N));
+#else
+    for(int k=0; k<LIGHT_WIDTH; k++) {
+        Vec3 toCenter = {node.cx[k] - P.x, node.cy[k] - P.y, node.cz[k] - P.z};
+        float d2 = dot(toCenter, toCenter);
+        float r2 = node.radius[k] * node.radius[k];
+        if(d2 <= r2) {
+            weights[k] = node.power[k] / max(r2, 1e-6f);
+            continue;
+        }
+        float a = dot(N, toCenter);
+        float tangent = sqrt(d2 - r2);
+        float cosD2 = a >= tangent ? d2 : a * tangent + node.radius[k] * sqrt(max(0.0f, d2 - a*a));
+        weights[k] = node.power[k] * max(0.0f, cosD2) / (d2 * d2);
+    }
+#endif
+}
+
+// Child weights and their inclusive prefix sums; unused lanes weigh 0, so the last sum is
+// the total. The sums stay in double so the sampled child and lightPmf agree exactly.
+void prefixWeights(const LightNode& node, Vec3 P, Vec3 N, float* weights, double* prefix) {
+#if defined(__AVX__)
+    _mm256_storeu_ps(weights, childImportance8(node, P, N));
+#else
+    childImportance(node, P, N, weights);
+#endif
+    double sum = 0;
+    for(int k=0; k<LIGHT_WIDTH; k++) prefix[k] = sum += weights[k];
+}
+
+// Walks from the root choosing each child in proportion to its importance.
+// Returns the chosen light with its probability in pmf, or -1 when no light can reach P.
+int sampleLight(const LightTree& tree, Vec3 P, Vec3 N, double u, float& pmf) {
+    pmf = 1;
+    if(tree.nodes.empty()) return -1;
+    int index = 0;
+    while(true) {
+        const LightNode& node = tree.nodes[index];
+        float weights[LIGHT_WIDTH];
+        double prefix[LIGHT_WIDTH];
+        prefixWeights(node, P, N, weights, prefix);
+        double total = prefix[LIGHT_WIDTH - 1];
+        if(total <= 0) return -1;
+
+        // The child whose share of [0, total) holds u * total, counted without branches
+        double target = u * total;
+        int k = 0;
+        for(int j=0; j<LIGHT_WIDTH; j++) k += prefix[j] <= target;
+        k = min(k, node.count - 1);
+        while(k > 0 && weights[k] <= 0) k--;     // rounding ran past the last nonzero child
+        double below = k > 0 ? prefix[k - 1] : 0.0;
+
+        // Reuse u: rescale the chosen sub-interval back to [0, 1)
+        pmf *= float(weights[k] / total);
+        u = min(max((target - below) / weights[k], 0.0), 1.0 - 1e-12);
+        if(node.child[k] < 0) return node.first[k];
+        index = node.child[k];
+    }
+}
+
+// Probability that sampleLight picks light at P, following the same decisions
+float lightPmf(const LightTree& tree, Vec3 P, Vec3 N, int light) {
+    float pmf = 1;
+    int index = 0;
+    while(true) {
+        const LightNode& node = tree.nodes[index];
+        float weights[LIGHT_WIDTH];
+        double prefix[LIGHT_WIDTH];
+        prefixWeights(node, P, N, weights, prefix);
+        double total = prefix[LIGHT_WIDTH - 1];
+        if(total <= 0) return 0;
+
+        int k = node.count - 1;
+        while(node.first[k] > light) k--;
+        pmf *= float(weights[k] / total);
+        if(node.child[k] < 0) return pmf;
+        index = node.child[k];
+    }
+}
+
+struct Rng {
+    uint64_t state;
+
+    double next() {   // uniform in [0, 1)
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (state >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+// Deterministic per-pixel seed, so the image does not depend on the thread schedule
+uint64_t pixelSeed(int pixel) {
+    uint64_t z = uint64_t(pixel) * 0x9E3779B97F4A7C15ULL + 0x632BE59BD9B4E019ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Random lights spread over a box above the scene, total intensity totalIntensity
+vector<PointLight> makeLightRig(int count, float totalIntensity) {
+    vector<PointLight> lights(count);
+    Rng rng{12345};
+    for(PointLight& l : lights) {
+        l.position = {float(-4 + 8*rng.next()), float(1 + 3*rng.next()), float(-7 + 7*rng.next())};
+        Vec3 tint = {float(0.5 + rng.next()), float(0.5 + rng.next()), float(0.5 + rng.next())};
+        l.intensity = multiply(tint, totalIntensity / count);
+    }
+    return lights;
+}
+
+// Checks at a few surface points that every light able to reach the point has a
+// nonzero pmf, that the pmf sums to at most 1 (the rest is the chance of picking no
+// light because a whole subtree faces away) and that the one-light estimator
+// averages to the sum over all lights, for the tree the render used
+void checkLightSampling(const LightTree& tree) {
+    Rng rng{777};
+    double worstEstimate = 0, minPmfSum = 1, maxPmfSum = 0;
+    int missed = 0;
+    for(int trial=0; trial<8; trial++) {
+        Vec3 P = {float(-2 + 4*rng.next()), float(-0.5 + rng.next()), float(-5 + 3*rng.next())};
+        Vec3 N = normalize({float(rng.next() - 0.5), 1, float(rng.next() - 0.5)});
+
+        double pmfSum = 0, exact = 0;
+        for(int i=0; i<int(tree.lights.size()); i++) {
+            float pmf = lightPmf(tree, P, N, i);
+            Vec3 toLight = subtract(tree.lights[i].position, P);
+            float d2 = dot(toLight, toLight);
+            float contribution = lightPower(tree.lights[i]) * max(0.0f, dot(N, toLight)) / (d2 * sqrt(d2));
+            if(contribution > 0 && pmf <= 0) missed++;
+            pmfSum += pmf;
+            exact += contribution;
+        }
+
+        const int SAMPLES = 1000000;
+        double estimate = 0;
+        for(int k=0; k<SAMPLES; k++) {
+            float pmf;
+            int i = sampleLight(tree, P, N, rng.next(), pmf);
+            if(i < 0) continue;
+            Vec3 toLight = subtract(tree.lights[i].position, P);
+            float d2 = dot(toLight, toLight);
+            estimate += lightPower(tree.lights[i]) * max(0.0f, dot(N, toLight)) / (d2 * sqrt(d2)) / pmf;
+        }
+        estimate /= SAMPLES;
+
+        minPmfSum = min(minPmfSum, pmfSum);
+        maxPmfSum = max(maxPmfSum, pmfSum);
+        // A point no light reaches must estimate exactly 0
+        worstEstimate = max(worstEstimate, exact > 0 ? fabs(estimate - exact) / exact : fabs(estimate));
+    }
+    cout << "Light sampling check: " << missed << " reachable lights with zero pmf, pmf sums in ["
+         << minPmfSum << ", " << maxPmfSum << "], mean estimate within "
+         << worstEstimate * 100 << "% of the exact sum (1M samples)\n";
+}
+
+/* =======================
+   Materials
+   ======================= */
+const float PI = 3.14159265f;
+
+enum MaterialType { MATERIAL_LAMBERT, MATERIAL_PHONG, MATERIAL_PBR, MATERIAL_TYPES };
+
+// Each model keeps its parameters in its own table; a primitive names one entry
+struct MaterialRef {
+    MaterialType type;
+    int index;
+};
+
+struct LambertMaterial { Vec3 albedo; };
+struct PhongMaterial { Vec3 ka, kd, ks; float shininess; };
+struct PBRMaterial { Vec3 albedo; float metallic, roughness; };
+
+struct MaterialTable {
+    vector<LambertMaterial> lambert;
+    vector<PhongMaterial> phong;
+    vector<PBRMaterial> pbr;
+
+    MaterialRef add(const LambertMaterial& m) { lambert.push_back(m); return {MATERIAL_LAMBERT, int(lambert.size()) - 1}; }
+    MaterialRef add(const PhongMaterial& m) { phong.push_back(m); return {MATERIAL_PHONG, int(phong.size()) - 1}; }
+    MaterialRef add(const PBRMaterial& m) { pbr.push_back(m); return {MATERIAL_PBR, int(pbr.size()) - 1}; }
+};
+
+// Default parameters of each model for a base color
+MaterialRef addMaterial(MaterialTable& table, MaterialType type, Vec3 color) {
+    switch(type) {
+    case MATERIAL_PHONG:
+        return table.add(PhongMaterial{multiply(color, 0.1f), multiply(color, 0.9f), {0.5f, 0.5f, 0.5f}, 32});
+    case MATERIAL_PBR:
+        return table.add(PBRMaterial{color, 0.0f, 0.4f});
+    default:
+        return table.add(LambertMaterial{color});
+    }
+}
+
 struct Sphere {
     Vec3 center;
     float radius;
-    Vec3 color;
+    MaterialRef material;
 };
 
 /* =======================
-   Ray–Sphere intersection
+   SoA sphere set + 8-wide kernels
    ======================= */
-bool hitSphere(Ray ray, Sphere s, float &t) {
+// Sphere centers and squared radii in separate arrays, padded to a multiple of 8
+struct SphereSoA {
+    vector<float> cx, cy, cz, r2;
+    int count;
+};
+
+SphereSoA makeSphereSoA(const vector<Sphere>& scene) {
+    SphereSoA soa;
+    soa.count = scene.size();
+    int padded = (soa.count + 7) / 8 * 8;
+    soa.cx.assign(padded, 0); soa.cy.assign(padded, 0);
+    soa.cz.assign(padded, 0); soa.r2.assign(padded, 0);
+    for(int i=0;i<soa.count;i++) {
+        soa.cx[i] = scene[i].center.x;
+        soa.cy[i] = scene[i].center.y;
+        soa.cz[i] = scene[i].center.z;
+        soa.r2[i] = scene[i].radius * scene[i].radius;
+    }
+    return soa;
+}
+
+// Nearest sphere hit with t > 0 from the ray-sphere quadratic; returns -1 on miss
+int closestSphere(const SphereSoA& soa, const Ray& ray, float &tHit) {
+    int hitIndex = -1;
+    tHit = 1e9;
+    float a = dot(ray.direction, ray.direction);
+#if defined(__AVX__)
+    __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+    __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    __m256 four_a = _mm256_set1_ps(4 * a), two_a = _mm256_set1_ps(2 * a);
+    __m256 two = _mm256_set1_ps(2), zero = _mm256_setzero_ps();
+    __m256 lane = _mm256_setr_ps(0,1,2,3,4,5,6,7);
+    __m256 best = _mm256_set1_ps(tHit);
+    __m256 bestIdx = _mm256_set1_ps(-1);
+
+    for(int i=0;i<soa.count;i+=8) {
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&soa.cx[i]));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&soa.cy[i]));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&soa.cz[i]));
+        __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+                                 _mm256_loadu_ps(&soa.r2[i]));
+        __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(four_a, c));
+        __m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(zero, b), _mm256_sqrt_ps(disc)), two_a);
+
+        __m256 ok = _mm256_cmp_ps(disc, zero, _CMP_GE_OQ);
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, best, _CMP_LT_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(lane, _mm256_set1_ps(soa.count - i), _CMP_LT_OQ));
+        best = _mm256_blendv_ps(best, t, ok);
+        bestIdx = _mm256_blendv_ps(bestIdx, _mm256_add_ps(lane, _mm256_set1_ps(i)), ok);
+    }
 
-    Vec3 oc = subtract(ray.origin, s.center);
+    // Lane minimum; ties go to the lower sphere index like the scalar loop
+    float ts[8], idx[8];
+    _mm256_storeu_ps(ts, best);
+    _mm256_storeu_ps(idx, bestIdx);
+    for(int k=0;k<8;k++) {
+        if(idx[k] < 0) continue;
+        if(ts[k] < tHit || (ts[k] == tHit && int(idx[k]) < hitIndex)) {
+            tHit = ts[k];
+            hitIndex = int(idx[k]);
+        }
+    }
+#else
+    for(int i=0;i<soa.count;i++) {
+        Vec3 oc = subtract(ray.origin, {soa.cx[i], soa.cy[i], soa.cz[i]});
+        float b = 2 * dot(oc, ray.direction);
+        float c = dot(oc, oc) - soa.r2[i];
+        float disc = b*b - 4*a*c;
+        if(disc < 0) continue;
+        float t = (-b - sqrt(disc)) / (2*a);
+        if(t > 0 && t < tHit) {
+            tHit = t;
+            hitIndex = i;
+        }
+    }
+#endif
+    return hitIndex;
+}
 
+// Bit k set when sphere first+k is hit with 0 < t < tMax; first is a multiple of 8.
+// Both the full occlusion query and the cached single-sphere test go through here,
+// so they agree bit for bit on every sphere.
+int occluderMask(const SphereSoA& soa, const Ray& ray, float tMax, int first) {
     float a = dot(ray.direction, ray.direction);
-    float b = 2 * dot(oc, ray.direction);
-    float c = dot(oc, oc) - s.radius*s.radius;
+#if defined(__AVX__)
+    __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    __m256 two = _mm256_set1_ps(2), zero = _mm256_setzero_ps();
+    __m256 lane = _mm256_setr_ps(0,1,2,3,4,5,6,7);
+
+    __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(&soa.cx[first]));
+    __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(&soa.cy[first]));
+    __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(&soa.cz[first]));
+    __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz)));
+    __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+                             _mm256_loadu_ps(&soa.r2[first]));
+    __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_set1_ps(4 * a), c));
+    __m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(zero, b), _mm256_sqrt_ps(disc)), _mm256_set1_ps(2 * a));
+
+    __m256 ok = _mm256_cmp_ps(disc, zero, _CMP_GE_OQ);
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(lane, _mm256_set1_ps(soa.count - first), _CMP_LT_OQ));
+    return _mm256_movemask_ps(ok);
+#else
+    int mask = 0;
+    for(int i=first; i<min(first + 8, soa.count); i++) {
+        Vec3 oc = subtract(ray.origin, {soa.cx[i], soa.cy[i], soa.cz[i]});
+        float b = 2 * dot(oc, ray.direction);
+        float c = dot(oc, oc) - soa.r2[i];
+        float disc = b*b - 4*a*c;
+        if(disc < 0) continue;
+        float t = (-b - sqrt(disc)) / (2*a);
+        if(t > 0 && t < tMax) mask |= 1 << (i - first);
+    }
+    return mask;
+#endif
+}
+
+// Occlusion test: index of the first sphere found with 0 < t < tMax, or -1
+int findOccluder(const SphereSoA& soa, const Ray& ray, float tMax) {
+    for(int i=0;i<soa.count;i+=8) {
+        int mask = occluderMask(soa, ray, tMax, i);
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    return -1;
+}
+
+bool occludedBy(const SphereSoA& soa, const Ray& ray, float tMax, int sphere) {
+    return (occluderMask(soa, ray, tMax, sphere & ~7) >> (sphere & 7)) & 1;
+}
 
-    float disc = b*b - 4*a*c;
-    if (disc < 0) return false;
+/* =======================
+   Occlusion cache
+   ======================= */
+// Neighbouring pixels are usually shadowed from a light by the same sphere, so each
+// thread remembers the last occluder it found per light and tries it before a full
+// query. Only the order of the tests changes, so the answer is exactly the same.
+struct OcclusionCache {
+    vector<int> lastOccluder;   // per light, -1 = none yet
+    long long queries = 0, blocked = 0, hits = 0, traversals = 0;
+};
 
-    t = (-b - sqrt(disc)) / (2*a);
-    return t > 0;
+bool occluded(OcclusionCache& cache, const SphereSoA& soa, const Ray& ray, float tMax, int light) {
+    bool enabled = !cache.lastOccluder.empty();
+    cache.queries++;
+    if(enabled && cache.lastOccluder[light] >= 0 && occludedBy(soa, ray, tMax, cache.lastOccluder[light])) {
+        cache.blocked++;
+        cache.hits++;
+        return true;
+    }
+    cache.traversals++;
+    int occluder = findOccluder(soa, ray, tMax);
+    if(occluder < 0) return false;
+    cache.blocked++;
+    if(enabled) cache.lastOccluder[light] = occluder;
+    return true;
 }
 
-int main() {
+/* =======================
+   Material-sorted shading
+   ======================= */
+// One light sample at a hit waiting to be shaded; N, V (toward the eye) and L
+// are unit length. A pixel with several light samples gets one ShadeHit each,
+// and their results are summed.
+struct ShadeHit {
+    int pixel;
+    MaterialRef material;
+    Vec3 N, V, L;
+    Vec3 light;     // irradiance from L at normal incidence, divided by pmf and sample count
+    float share;    // this sample's share of light-independent terms (1 / samples)
+};
+
+// MaterialModel<T> names a model's parameter table and its shading function.
+// Shading is resolved at compile time; there is no per-hit dispatch.
+template <MaterialType T> struct MaterialModel;
+
+template <> struct MaterialModel<MATERIAL_LAMBERT> {
+    static const vector<LambertMaterial>& table(const MaterialTable& m) { return m.lambert; }
+
+    static Vec3 shade(const LambertMaterial& p, const ShadeHit& h) {
+        return multiply(multiply(p.albedo, h.light), max(0.0f, dot(h.N, h.L)));
+    }
+};
+
+template <> struct MaterialModel<MATERIAL_PHONG> {
+    static const vector<PhongMaterial>& table(const MaterialTable& m) { return m.phong; }
+
+    // Ambient plus light-scaled diffuse and specular, as phong() in basic_phong.cpp,
+    // except that lights behind the surface add no highlight
+    static Vec3 shade(const PhongMaterial& p, const ShadeHit& h) {
+        float NdotL = dot(h.N, h.L);
+        float RdotV = 2 * NdotL * dot(h.N, h.V) - dot(h.L, h.V);
+        float spec = NdotL > 0 ? powf(max(0.0f, RdotV), p.shininess) : 0.0f;
+        Vec3 direct = add(multiply(p.kd, max(0.0f, NdotL)), multiply(p.ks, spec));
+        return add(multiply(p.ka, h.share), multiply(direct, h.light));
+    }
+};
+
+template <> struct MaterialModel<MATERIAL_PBR> {
+    static const vector<PBRMaterial>& table(const MaterialTable& m) { return m.pbr; }
+
+    // GGX / Schlick-GGX / Schlick as PBR() in pbr_renderer.cpp. The light's
+    // radiance is pi, so a rough dielectric is about as bright as Lambert here.
+    static Vec3 shade(const PBRMaterial& p, const ShadeHit& h) {
+        float NdotL = max(0.0f, dot(h.N, h.L));
+        float NdotV = max(0.0f, dot(h.N, h.V));
+        Vec3 H = normalize(add(h.V, h.L));
+        float NdotH = max(0.0f, dot(h.N, H));
+        float m = 1 - max(0.0f, dot(H, h.V));
+        float w = m*m*m*m*m;
+
+        float a = p.roughness * p.roughness;
+        float a2 = a * a;
+        float k = (p.roughness + 1) * (p.roughness + 1) / 8;
+        float d = NdotH*NdotH*(a2 - 1) + 1;
+        float spec = a2 * NdotV * NdotL /
+                     (PI * d*d * (NdotV*(1-k) + k) * (NdotL*(1-k) + k) * (4*NdotV*NdotL + 1e-5f));
+
+        const float* albedo = &p.albedo.x;
+        const float* light = &h.light.x;
+        float rgb[3];
+        for(int c=0; c<3; c++) {
+            float F0 = 0.04f * (1 - p.metallic) + albedo[c] * p.metallic;
+            float F = F0 + (1 - F0) * w;
+            float kD = (1 - F) * (1 - p.metallic);
+            rgb[c] = (kD * albedo[c] + PI * F * spec) * NdotL * light[c];
+        }
+        return {rgb[0], rgb[1], rgb[2]};
+    }
+};
+
+// Shades a run of hits that all use model T, adding into their pixels
+template <MaterialType T>
+void shadeRun(const MaterialTable& materials, const ShadeHit* hits, int count, vector<Vec3>& framebuffer) {
+    const auto& params = MaterialModel<T>::table(materials);
+    for(int i=0; i<count; i++) {
+        Vec3& pixel = framebuffer[hits[i].pixel];
+        pixel = add(pixel, MaterialModel<T>::shade(params[hits[i].material.index], hits[i]));
+    }
+}
+
+// Groups hits by model with a counting sort into sorted, then shades each group in one run.
+// counts[t] accumulates the number of hits shaded with model t.
+void shadeHits(const MaterialTable& materials, const vector<ShadeHit>& hits, vector<ShadeHit>& sorted,
+               vector<Vec3>& framebuffer, long long* counts) {
+    int start[MATERIAL_TYPES + 1] = {0};
+    for(const ShadeHit& h : hits) start[h.material.type + 1]++;
+    for(int t=0; t<MATERIAL_TYPES; t++) {
+        counts[t] += start[t + 1];
+        start[t + 1] += start[t];
+    }
+
+    sorted.resize(hits.size());
+    int cursor[MATERIAL_TYPES];
+    copy(start, start + MATERIAL_TYPES, cursor);
+    for(const ShadeHit& h : hits) sorted[cursor[h.material.type]++] = h;
+
+    const ShadeHit* base = sorted.data();
+    shadeRun<MATERIAL_LAMBERT>(materials, base + start[MATERIAL_LAMBERT], start[MATERIAL_LAMBERT + 1] - start[MATERIAL_LAMBERT], framebuffer);
+    shadeRun<MATERIAL_PHONG>(materials, base + start[MATERIAL_PHONG], start[MATERIAL_PHONG + 1] - start[MATERIAL_PHONG], framebuffer);
+    shadeRun<MATERIAL_PBR>(materials, base + start[MATERIAL_PBR], start[MATERIAL_PBR + 1] - start[MATERIAL_PBR], framebuffer);
+}
+
+/* =======================
+   Tile scheduler (work stealing)
+   ======================= */
+struct Tile { int x0, y0, x1, y1; };
+
+// Per-thread scratch state, reused across all tiles a worker renders.
+// Cache-line aligned so workers bumping their counters do not false-share.
+struct alignas(64) ThreadScratch {
+    long long rays = 0;
+    vector<ShadeHit> hits, sorted;
+    long long shaded[MATERIAL_TYPES] = {};
+    double shadeSeconds = 0;
+    OcclusionCache occlusion;
+};
+
+// Each worker pops from the back of its own queue and steals from the front of others
+struct TileQueue {
+    mutex lock;
+    deque<int> tiles;
+};
+
+// Renders every tile exactly once across threadCount workers.
+// Output is deterministic as long as renderTile only writes its own pixels.
+template <typename RenderTile>
+void renderTiles(int width, int height, int tileSize, int threadCount,
+                 vector<ThreadScratch>& scratch, RenderTile renderTile) {
+    vector<Tile> tiles;
+    for(int y=0; y<height; y+=tileSize)
+        for(int x=0; x<width; x+=tileSize)
+            tiles.push_back({x, y, min(x+tileSize, width), min(y+tileSize, height)});
+
+    vector<TileQueue> queues(threadCount);
+    for(size_t i=0; i<tiles.size(); i++)
+        queues[i * threadCount / tiles.size()].tiles.push_back(i);
+    scratch.assign(threadCount, ThreadScratch());
+
+    auto worker = [&](int id) {
+        while(true) {
+            int tile = -1;
+            {
+                lock_guard<mutex> g(queues[id].lock);
+                if(!queues[id].tiles.empty()) {
+                    tile = queues[id].tiles.back();
+                    queues[id].tiles.pop_back();
+                }
+            }
+            for(int k=1; tile<0 && k<threadCount; k++) {
+                TileQueue& victim = queues[(id+k) % threadCount];
+                lock_guard<mutex> g(victim.lock);
+                if(!victim.tiles.empty()) {
+                    tile = victim.tiles.front();
+                    victim.tiles.pop_front();
+                }
+            }
+            // No tiles are added after startup, so empty queues everywhere means done
+            if(tile < 0) return;
+            renderTile(tiles[tile], scratch[id]);
+        }
+    };
+
+    vector<thread> pool;
+    for(int id=1; id<threadCount; id++) pool.emplace_back(worker, id);
+    worker(0);
+    for(thread& t : pool) t.join();
+}
+
+/* =======================
+   Image output
+   ======================= */
+enum ImageFormat { FORMAT_P6, FORMAT_PFM };
+
+struct OutputOptions {
+    ImageFormat format = FORMAT_P6;
+    float gamma = 1.0f;     // 1.0 keeps the linear values as they are
+    bool useMmap = false;   // write through a memory-mapped file
+};
+
+// Clamp to [0,1], apply 1/gamma and quantize to 8 bits.
+// The loop is branch-free so the compiler can vectorize it.
+void quantize(const float* src, unsigned char* dst, size_t n, float gamma) {
+    if(gamma == 1.0f) {
+        for(size_t i=0; i<n; i++)
+            dst[i] = (unsigned char)(min(max(src[i], 0.0f), 1.0f) * 255.0f);
+    } else {
+        float invGamma = 1.0f / gamma;
+        for(size_t i=0; i<n; i++)
+            dst[i] = (unsigned char)(powf(min(max(src[i], 0.0f), 1.0f), invGamma) * 255.0f);
+    }
+}
+
+// PFM records the float byte order in the sign of its scale: negative for little-endian
+bool hostIsLittleEndian() {
+    uint16_t probe = 1;
+    unsigned char first;
+    memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+string imageHeader(int width, int height, const OutputOptions& opts) {
+    if(opts.format == FORMAT_PFM)
+        return "PF\n" + to_string(width) + " " + to_string(height) +
+               (hostIsLittleEndian() ? "\n-1.0\n" : "\n1.0\n");
+    return "P6\n" + to_string(width) + " " + to_string(height) + "\n255\n";
+}
+
+size_t imageSize(int width, int height, const OutputOptions& opts) {
+    size_t pixels = size_t(width) * height * 3;
+    return imageHeader(width, height, opts).size() +
+           pixels * (opts.format == FORMAT_PFM ? sizeof(float) : 1);
+}
+
+// Encodes a top-to-bottom framebuffer into out, which must hold imageSize() bytes.
+// PFM stores host-order floats with rows bottom to top.
+void encodeImage(const vector<Vec3>& framebuffer, int width, int height,
+                 const OutputOptions& opts, unsigned char* out) {
+    string header = imageHeader(width, height, opts);
+    memcpy(out, header.data(), header.size());
+    out += header.size();
+
+    const float* pixels = &framebuffer[0].x;
+    size_t rowFloats = size_t(width) * 3;
+    if(opts.format == FORMAT_PFM) {
+        for(int row=0; row<height; row++)
+            memcpy(out + row*rowFloats*sizeof(float),
+                   pixels + (height-1 - row)*rowFloats, rowFloats*sizeof(float));
+    } else {
+        quantize(pixels, out, rowFloats * height, opts.gamma);
+    }
+}
+
+bool writeImage(const string& path, const vector<Vec3>& framebuffer, int width, int height,
+                const OutputOptions& opts) {
+    size_t size = imageSize(width, height, opts);
+#if defined(__unix__)
+    if(opts.useMmap) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) return false;
+        if(ftruncate(fd, size) != 0) { close(fd); return false; }
+        void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(map == MAP_FAILED) return false;
+        encodeImage(framebuffer, width, height, opts, (unsigned char*)map);
+        return munmap(map, size) == 0;
+    }
+#endif
+    vector<unsigned char> bytes(size);
+    encodeImage(framebuffer, width, height, opts, bytes.data());
+    ofstream file(path, ios::binary);
+    file.write((const char*)bytes.data(), bytes.size());
+    return bool(file);
+}
+
+// Encodes and writes frames on a background thread so output overlaps rendering
+class AsyncImageWriter {
+public:
+    AsyncImageWriter() : worker(&AsyncImageWriter::run, this) {}
+
+    struct Result {
+        string path;
+        bool ok;
+    };
+
+    ~AsyncImageWriter() { finish(); }
+
+    // Waits for every submitted frame; the caller reports the results, so only the
+    // calling thread writes to cout
+    vector<Result> finish() {
+        {
+            lock_guard<mutex> g(lock);
+            done = true;
+        }
+        wake.notify_one();
+        if(worker.joinable()) worker.join();
+        return move(results);
+    }
+
+    // Takes ownership of the framebuffer; the caller can start the next frame immediately
+    void submit(const string& path, vector<Vec3>&& framebuffer, int width, int height,
+                const OutputOptions& opts) {
+        {
+            lock_guard<mutex> g(lock);
+            jobs.push_back({path, move(framebuffer), width, height, opts});
+        }
+        wake.notify_one();
+    }
+
+private:
+    struct Job {
+        string path;
+        vector<Vec3> framebuffer;
+        int width, height;
+        OutputOptions opts;
+    };
+
+    void run() {
+        while(true) {
+            Job job;
+            {
+                unique_lock<mutex> g(lock);
+                wake.wait(g, [&]{ return done || !jobs.empty(); });
+                if(jobs.empty()) return;
+                job = move(jobs.front());
+                jobs.pop_front();
+            }
+            bool ok = writeImage(job.path, job.framebuffer, job.width, job.height, job.opts);
+            lock_guard<mutex> g(lock);
+            results.push_back({job.path, ok});
+        }
+    }
+
+    mutex lock;
+    condition_variable wake;
+    deque<Job> jobs;
+    vector<Result> results;
+    bool done = false;
+    thread worker;
+};
+
+// Value following name on the command line, or nullptr
+const char* findArg(int argc, char** argv, const char* name) {
+    for(int i=1; i+1<argc; i++)
+        if(string(argv[i]) == name) return argv[i+1];
+    return nullptr;
+}
+
+bool hasFlag(int argc, char** argv, const char* name) {
+    for(int i=1; i<argc; i++)
+        if(string(argv[i]) == name) return true;
+    return false;
+}
+
+// --format p6|pfm, --gamma G and --mmap; false after reporting an unknown format
+bool parseOutput(int argc, char** argv, OutputOptions& opts) {
+    const char* format = findArg(argc, argv, "--format");
+    if(format && string(format) == "pfm") {
+        opts.format = FORMAT_PFM;
+    } else if(format && string(format) != "p6") {
+        cerr << "Unknown --format " << format << " (expected p6 or pfm)\n";
+        return false;
+    }
+    const char* gamma = findArg(argc, argv, "--gamma");
+    if(gamma) opts.gamma = max(0.01f, float(atof(gamma)));
+    opts.useMmap = hasFlag(argc, argv, "--mmap");
+    return true;
+}
+
+// --materials lambert|phong|pbr gives every sphere that model; the default (-1) mixes them.
+// Returns false after reporting an unknown model.
+bool parseMaterialModel(int argc, char** argv, int& forcedModel) {
+    forcedModel = -1;
+    const char* model = findArg(argc, argv, "--materials");
+    if(!model) return true;
+    if(string(model) == "lambert") forcedModel = MATERIAL_LAMBERT;
+    else if(string(model) == "phong") forcedModel = MATERIAL_PHONG;
+    else if(string(model) == "pbr") forcedModel = MATERIAL_PBR;
+    else {
+        cerr << "Unknown --materials " << model << " (expected lambert, phong or pbr)\n";
+        return false;
+    }
+    return true;
+}
+
+int parseCount(int argc, char** argv, const char* name, int fallback) {
+    const char* value = findArg(argc, argv, name);
+    return value ? max(1, atoi(value)) : fallback;
+}
+
+int parseThreads(int argc, char** argv) {
+    const char* threads = findArg(argc, argv, "--threads");
+    if(threads) return max(1, atoi(threads));
+    return max(1u, thread::hardware_concurrency());
+}
+
+int main(int argc, char** argv) {
 
     const int WIDTH = 500;
     const int HEIGHT = 400;
 
     Vec3 camera = {0,0,0};
-    Vec3 lightPos = {2,2,0};
 
-    // Scene with multiple spheres
-    vector<Sphere> scene = {
-        {{0,0,-3}, 0.5, {1,0,0}},
-        {{1,-0.2,-4}, 0.7, {0,1,0}}
+    // One light at (2,2,0) by default; --lights N spreads N lights over the scene.
+    // Either way the total intensity gives about unit irradiance at the front sphere.
+    int lightCount = parseCount(argc, argv, "--lights", 1);
+    int lightSamples = parseCount(argc, argv, "--light-samples", 1);
+    vector<PointLight> lights = lightCount == 1
+        ? vector<PointLight>{{{2,2,0}, {17,17,17}}}
+        : makeLightRig(lightCount, 25);
+    auto buildStart = chrono::steady_clock::now();
+    LightTree lightTree = buildLightTree(lights);
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - buildStart).count();
+
+    // Scene with multiple spheres, each with its own material model
+    struct SphereDesc { Vec3 center; float radius; Vec3 color; MaterialType model; };
+    const SphereDesc sceneDesc[] = {
+        {{0,0,-3}, 0.5, {1,0,0}, MATERIAL_PHONG},
+        {{1,-0.2,-4}, 0.7, {0,1,0}, MATERIAL_PBR},
+        {{0,-100.9,-4}, 100, {0.6f,0.6f,0.6f}, MATERIAL_LAMBERT}
     };
+    int forcedModel;
+    if(!parseMaterialModel(argc, argv, forcedModel)) return 1;
 
-    ofstream image("ray_casting_pro.ppm");
-    image << "P3\n" << WIDTH << " " << HEIGHT << "\n255\n";
-
-    // Loop over pixels
-    for(int y=HEIGHT-1; y>=0; y--) {
-        for(int x=0; x<WIDTH; x++) {
-
-            // Generate ray
-            Vec3 dir = normalize({
-                (x+0.5f)/WIDTH - 0.5f,
-                (y+0.5f)/HEIGHT - 0.5f,
-                -1
-            });
-
-            Ray ray = {camera, dir};
-
-            float closest = 1e9;
-            int hitIndex = -1;
-            float tHit;
-
-            // Find closest sphere hit
-            for(int i=0;i<scene.size();i++) {
-                float t;
-                if(hitSphere(ray, scene[i], t) && t < closest) {
-                    closest = t;
-                    hitIndex = i;
-                    tHit = t;
-                }
-            }
+    MaterialTable materials;
+    vector<Sphere> scene;
+    for(const SphereDesc& d : sceneDesc) {
+        MaterialType model = forcedModel < 0 ? d.model : MaterialType(forcedModel);
+        scene.push_back({d.center, d.radius, addMaterial(materials, model, d.color)});
+    }
+
+    // --occluders N hangs N small spheres between the lights and the ground
+    int occluderCount = parseCount(argc, argv, "--occluders", 0);
+    if(occluderCount > 0) {
+        MaterialRef occluderMaterial = addMaterial(materials, forcedModel < 0 ? MATERIAL_LAMBERT : MaterialType(forcedModel),
+                                                   {0.8f, 0.7f, 0.3f});
+        Rng rng{4242};
+        for(int i=0; i<occluderCount; i++) {
+            Vec3 center = {float(-3 + 6*rng.next()), float(-0.6 + 1.4*rng.next()), float(-8 + 6*rng.next())};
+            scene.push_back({center, float(0.05 + 0.1*rng.next()), occluderMaterial});
+        }
+    }
+    bool useOcclusionCache = !hasFlag(argc, argv, "--no-occlusion-cache");
+
+    SphereSoA sceneSoA = makeSphereSoA(scene);
+
+    const int TILE = 16;
+    int threads = parseThreads(argc, argv);
+    OutputOptions output;
+    if(!parseOutput(argc, argv, output)) return 1;
+    AsyncImageWriter writer;
 
-            // Background color
-            Vec3 color = {0.1f, 0.1f, 0.1f};
+    // Framebuffer rows are stored top to bottom, matching the file order
+    vector<Vec3> framebuffer(WIDTH * HEIGHT);
+    vector<ThreadScratch> scratch;
 
-            if(hitIndex != -1) {
+    auto start = chrono::steady_clock::now();
+    renderTiles(WIDTH, HEIGHT, TILE, threads, scratch,
+                [&](const Tile& tile, ThreadScratch& local) {
+        local.hits.clear();
+        if(useOcclusionCache && local.occlusion.lastOccluder.empty())
+            local.occlusion.lastOccluder.assign(lightTree.lights.size(), -1);
+        for(int row=tile.y0; row<tile.y1; row++) {
+            int y = HEIGHT-1 - row;
+            for(int x=tile.x0; x<tile.x1; x++) {
 
-                Sphere s = scene[hitIndex];
+                // Generate ray
+                Vec3 dir = normalize({
+                    (x+0.5f)/WIDTH - 0.5f,
+                    (y+0.5f)/HEIGHT - 0.5f,
+                    -1
+                });
+
+                Ray ray = {camera, dir};
+                local.rays++;
+
+                // Find closest sphere hit
+                float tHit;
+                int hitIndex = closestSphere(sceneSoA, ray, tHit);
+
+                if(hitIndex == -1) {
+                    // Background color
+                    framebuffer[row*WIDTH + x] = {0.1f, 0.1f, 0.1f};
+                    continue;
+                }
+
+                const Sphere& s = scene[hitIndex];
+                int pixel = row*WIDTH + x;
 
                 // Compute hit point
                 Vec3 hitPoint = add(ray.origin,
@@ -116,41 +1027,87 @@ int main() {
 
                 // Surface normal
                 Vec3 N = normalize(subtract(hitPoint, s.center));
+                Vec3 V = multiply(ray.direction, -1);
+
+                // Shadow rays start slightly off the surface to avoid self-intersection
+                Vec3 shadowOrigin = add(hitPoint, multiply(N, 0.001f));
 
-                // Light direction
-                Vec3 L = normalize(subtract(lightPos, hitPoint));
+                // Pick lights in proportion to their estimated contribution
+                framebuffer[pixel] = {0, 0, 0};
+                Rng rng{pixelSeed(pixel)};
+                for(int k=0; k<lightSamples; k++) {
+                    float pmf;
+                    int lightIndex = sampleLight(lightTree, hitPoint, N, rng.next(), pmf);
+                    Vec3 L = N, light = {0, 0, 0};
 
-                // Shadow ray (offset to avoid self-intersection)
-                Ray shadowRay = {
-                    add(hitPoint, multiply(N, 0.001f)),
-                    L
-                };
+                    if(lightIndex >= 0) {
+                        const PointLight& source = lightTree.lights[lightIndex];
+                        Vec3 toLight = subtract(source.position, hitPoint);
+                        float dist2 = dot(toLight, toLight);
+                        float dist = sqrt(dist2);
+                        L = multiply(toLight, 1 / dist);
 
-                bool inShadow = false;
+                        // Shadow check
+                        bool inShadow = occluded(local.occlusion, sceneSoA, {shadowOrigin, L}, dist, lightIndex);
+                        local.rays++;
 
-                // Shadow check
-                for(auto obj : scene) {
-                    float t;
-                    if(hitSphere(shadowRay, obj, t)) {
-                        inShadow = true;
-                        break;
+                        float scale = (inShadow ? 0.2f : 1.0f) / (dist2 * pmf * lightSamples);
+                        light = multiply(source.intensity, scale);
                     }
+
+                    // Shaded below, grouped by material
+                    local.hits.push_back({pixel, s.material, N, V, L, light, 1.0f / lightSamples});
                 }
+            }
+        }
 
-                // Lambertian lighting
-                float intensity = max(0.0f, dot(N, L));
-                if(inShadow) intensity *= 0.2f;
+        auto shadeStart = chrono::steady_clock::now();
+        shadeHits(materials, local.hits, local.sorted, framebuffer, local.shaded);
+        local.shadeSeconds += chrono::duration<double>(chrono::steady_clock::now() - shadeStart).count();
+    });
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-                color = multiply(s.color, intensity);
-            }
+    long long rays = 0, shaded[MATERIAL_TYPES] = {};
+    long long shadowQueries = 0, blocked = 0, cacheHits = 0, traversals = 0;
+    double shadeSeconds = 0;
+    for(const ThreadScratch& t : scratch) {
+        rays += t.rays;
+        shadowQueries += t.occlusion.queries;
+        blocked += t.occlusion.blocked;
+        cacheHits += t.occlusion.hits;
+        traversals += t.occlusion.traversals;
+        for(int m=0; m<MATERIAL_TYPES; m++) shaded[m] += t.shaded[m];
+        shadeSeconds += t.shadeSeconds;
+    }
+    long long hits = shaded[MATERIAL_LAMBERT] + shaded[MATERIAL_PHONG] + shaded[MATERIAL_PBR];
+
+    // Hand the frame to the writer thread
+    writer.submit(output.format == FORMAT_PFM ? "ray_casting_pro.pfm" : "ray_casting_pro.ppm",
+                  move(framebuffer), WIDTH, HEIGHT, output);
+
+    cout << "Rendered " << WIDTH << "x" << HEIGHT << " ("
+         << threads << " threads, " << rays / seconds / 1e6 << " Mrays/s)\n";
+    cout << lightTree.lights.size() << " lights, " << lightSamples << " sample(s) per hit, light tree built in "
+         << buildSeconds * 1e3 << " ms, " << seconds * 1e9 / (WIDTH * HEIGHT) << " ns/pixel\n";
+    cout << "Shaded " << hits << " hits (" << shaded[MATERIAL_LAMBERT] << " lambert, "
+         << shaded[MATERIAL_PHONG] << " phong, " << shaded[MATERIAL_PBR] << " pbr), "
+         << (hits ? shadeSeconds * 1e9 / hits : 0.0) << " ns/hit\n";
+    cout << scene.size() << " spheres, " << shadowQueries << " shadow rays (" << blocked << " blocked), occlusion cache "
+         << (useOcclusionCache ? "on" : "off") << ": " << cacheHits << " hits ("
+         << (blocked ? 100.0 * cacheHits / blocked : 0.0) << "% of blocked rays), "
+         << traversals << " full traversals\n";
 
-            // Write pixel
-            image << int(color.x*255) << " "
-                  << int(color.y*255) << " "
-                  << int(color.z*255) << "\n";
+    // Written files are reported here, after the writer thread has finished
+    int status = 0;
+    for(const AsyncImageWriter::Result& r : writer.finish()) {
+        if(r.ok) {
+            cout << r.path << " generated successfully\n";
+        } else {
+            cout << "failed to write " << r.path << "\n";
+            status = 1;
         }
     }
 
-    image.close();
-    cout << "ray_casting_pro.ppm generated successfully\n";
+    if(hasFlag(argc, argv, "--check-lights")) checkLightSampling(lightTree);
+    return status;
 }
@@ -1,5 +1,10 @@
 #include <iostream>
 #include <cmath>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
 using namespace std;
 
 struct Vec3 {
@@ -52,15 +57,24 @@ bool raySphere(Vec3 O, Vec3 D, Vec3 C, double r, double &t) {
     return t > 0;
 }
 
+const Vec3 SPHERE_C = {0,0,-5};
+const double SPHERE_R = 1;
+const Vec3 BACKGROUND = {0.2, 0.4, 0.8};
+const double N_OUTSIDE = 1.0, N_INSIDE = 1.5;
+
+long long gRaysCast = 0;
+
+// Recursive reference: follows both branches at every hit, 2^depth rays per sample
 Vec3 trace(Vec3 O, Vec3 D, int depth) {
     if (depth <= 0) return {0,0,0};
+    gRaysCast++;
 
-    Vec3 sphereC = {0,0,-5};
-    double sphereR = 1;
+    Vec3 sphereC = SPHERE_C;
+    double sphereR = SPHERE_R;
     double t;
 
     if (!raySphere(O,D,sphereC,sphereR,t))
-        return {0.2, 0.4, 0.8}; // background
+        return BACKGROUND;
 
     Vec3 P = add(O, scale(D,t));
     Vec3 N = normalize(subtract(P, sphereC));
@@ -70,7 +84,7 @@ Vec3 trace(Vec3 O, Vec3 D, int depth) {
 
     Vec3 T;
     Vec3 refrColor = {0,0,0};
-    if (refract(D, N, 1.0, 1.5, T)) {
+    if (refract(D, N, N_OUTSIDE, N_INSIDE, T)) {
         T = normalize(T);
         refrColor = trace(P, T, depth-1);
     }
@@ -78,14 +92,424 @@ Vec3 trace(Vec3 O, Vec3 D, int depth) {
     return add(scale(reflColor, 0.5), scale(refrColor, 0.5));
 }
 
+/* ---------------- STOCHASTIC TRACER ---------------- */
+
+struct Rng {
+    uint64_t state;
+
+    double next() {   // uniform in [0, 1)
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (state >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+// Schlick's approximation of the reflectance at a boundary between n1 and n2
+double fresnelSchlick(double cosI, double n1, double n2) {
+    double r0 = (n1 - n2) / (n1 + n2);
+    r0 *= r0;
+    double m = 1 - cosI;
+    return r0 + (1 - r0) * m*m*m*m*m;
+}
+
+const double MIN_BRANCH_PROB = 0.05;   // keeps 1/p bounded at grazing and normal incidence
+
+// Follows one branch per hit instead of both, so a sample costs at most depth rays.
+// trace()'s 0.5/0.5 mix stays the weight; Fresnel only decides how often each branch
+// is sampled. Dividing by the branch probability, and by the Russian-roulette survival
+// probability, keeps the expectation equal to trace() at the same depth.
+Vec3 traceStochastic(Vec3 O, Vec3 D, int depth, double throughput, Rng& rng) {
+    if (depth <= 0) return {0,0,0};
+    gRaysCast++;
+
+    double t;
+    if (!raySphere(O,D,SPHERE_C,SPHERE_R,t))
+        return BACKGROUND;
+
+    // Paths that can no longer add much are ended at random, with survivors reweighted
+    double survive = min(1.0, throughput);
+    if (rng.next() >= survive) return {0,0,0};
+
+    Vec3 P = add(O, scale(D,t));
+    Vec3 N = normalize(subtract(P, SPHERE_C));
+
+    Vec3 T;
+    bool canRefract = refract(D, N, N_OUTSIDE, N_INSIDE, T);
+    double pReflect = 1.0;   // total internal reflection: refraction contributes nothing
+    if (canRefract) {
+        double F = fresnelSchlick(fabs(dot(N, D)), N_OUTSIDE, N_INSIDE);
+        pReflect = min(max(F, MIN_BRANCH_PROB), 1 - MIN_BRANCH_PROB);
+    }
+
+    bool reflectBranch = rng.next() < pReflect;
+    double w = 0.5 / ((reflectBranch ? pReflect : 1 - pReflect) * survive);
+    Vec3 next = reflectBranch ? normalize(reflect(D, N)) : normalize(T);
+    return scale(traceStochastic(P, next, depth-1, throughput * w, rng), w);
+}
+
+/* ---------------- WAVEFRONT TRACER ---------------- */
+
+// One wave of path segments in SoA form. Each stage is a flat loop over these arrays.
+struct RayBatch {
+    vector<double> ox, oy, oz;
+    vector<double> dx, dy, dz;
+    vector<double> weight;     // product of the branch weights along the path
+    vector<int> pixel;         // accumulator that receives this path's radiance
+    vector<int> depth;         // remaining bounces, as in trace()
+    vector<double> t;          // intersect: hit distance, or -1 on a miss
+    vector<double> lr, lg, lb; // shade: radiance this segment adds to its pixel
+
+    size_t size() const { return ox.size(); }
+
+    void clear() {
+        for (vector<double>* a : {&ox, &oy, &oz, &dx, &dy, &dz, &weight, &t, &lr, &lg, &lb}) a->clear();
+        pixel.clear();
+        depth.clear();
+    }
+
+    void push(Vec3 O, Vec3 D, double w, int px, int d) {
+        ox.push_back(O.x); oy.push_back(O.y); oz.push_back(O.z);
+        dx.push_back(D.x); dy.push_back(D.y); dz.push_back(D.z);
+        weight.push_back(w);
+        pixel.push_back(px);
+        depth.push_back(d);
+    }
+
+    // this[i] = src[order[i]] for the ray state (not the per-stage outputs)
+    void gather(const RayBatch& src, const vector<uint32_t>& order) {
+        size_t n = order.size();
+        for (vector<double>* a : {&ox, &oy, &oz, &dx, &dy, &dz, &weight}) a->resize(n);
+        pixel.resize(n);
+        depth.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            uint32_t j = order[i];
+            ox[i] = src.ox[j]; oy[i] = src.oy[j]; oz[i] = src.oz[j];
+            dx[i] = src.dx[j]; dy[i] = src.dy[j]; dz[i] = src.dz[j];
+            weight[i] = src.weight[j];
+            pixel[i] = src.pixel[j];
+            depth[i] = src.depth[j];
+        }
+    }
+
+    void append(const RayBatch& b) {
+        auto cat = [](auto& dst, const auto& src) { dst.insert(dst.end(), src.begin(), src.end()); };
+        cat(ox, b.ox); cat(oy, b.oy); cat(oz, b.oz);
+        cat(dx, b.dx); cat(dy, b.dy); cat(dz, b.dz);
+        cat(weight, b.weight); cat(pixel, b.pixel); cat(depth, b.depth);
+    }
+};
+
+// Runs fn(begin, end, chunk) over [0, n) split into `chunks` contiguous ranges in parallel
+template <typename Fn>
+void parallelRanges(size_t n, size_t chunks, Fn fn) {
+    vector<thread> pool;
+    for (size_t c = 1; c < chunks; c++)
+        pool.emplace_back(fn, n * c / chunks, n * (c + 1) / chunks, c);
+    fn(0, n / chunks, 0);
+    for (thread& th : pool) th.join();
+}
+
+// Stage 1: same arithmetic as raySphere, written branch-free so the loop vectorizes
+void intersectBatch(RayBatch& b, size_t begin, size_t end) {
+    double r2 = SPHERE_R*SPHERE_R;
+    for (size_t i = begin; i < end; i++) {
+        double ocx = b.ox[i] - SPHERE_C.x, ocy = b.oy[i] - SPHERE_C.y, ocz = b.oz[i] - SPHERE_C.z;
+        double bq = 2 * (b.dx[i]*ocx + b.dy[i]*ocy + b.dz[i]*ocz);
+        double c = (ocx*ocx + ocy*ocy + ocz*ocz) - r2;
+        double disc = bq*bq - 4*c;
+        double t = (-bq - sqrt(max(disc, 0.0))) / 2;
+        b.t[i] = (disc >= 0 && t > 0) ? t : -1;
+    }
+}
+
+// Stage 2: misses pick up the background; hits spawn the reflected and refracted
+// segments into `out` with half the weight each, mirroring trace()
+void shadeBatch(RayBatch& b, size_t begin, size_t end, RayBatch& out) {
+    for (size_t i = begin; i < end; i++) {
+        double w = b.weight[i];
+        if (b.t[i] < 0) {
+            b.lr[i] = w*BACKGROUND.x; b.lg[i] = w*BACKGROUND.y; b.lb[i] = w*BACKGROUND.z;
+            continue;
+        }
+        b.lr[i] = b.lg[i] = b.lb[i] = 0;
+        if (b.depth[i] <= 1) continue;   // children would return black
+
+        Vec3 O = {b.ox[i], b.oy[i], b.oz[i]}, D = {b.dx[i], b.dy[i], b.dz[i]};
+        Vec3 P = add(O, scale(D, b.t[i]));
+        Vec3 N = normalize(subtract(P, SPHERE_C));
+        out.push(P, normalize(reflect(D, N)), w * 0.5, b.pixel[i], b.depth[i] - 1);
+
+        Vec3 T;
+        if (refract(D, N, N_OUTSIDE, N_INSIDE, T))
+            out.push(P, normalize(T), w * 0.5, b.pixel[i], b.depth[i] - 1);
+    }
+}
+
+/* ---------------- RAY SORTING ---------------- */
+
+// Spreads the low 10 bits of v so there are two zero bits between each
+uint64_t expandBits10(uint64_t v) {
+    v &= 0x3ff;
+    v = (v | v << 16) & 0x30000ff;
+    v = (v | v << 8) & 0x300f00f;
+    v = (v | v << 4) & 0x30c30c3;
+    v = (v | v << 2) & 0x9249249;
+    return v;
+}
+
+int rayOctant(double dx, double dy, double dz) {
+    return (dx < 0) | (dy < 0) << 1 | (dz < 0) << 2;
+}
+
+struct RayBounds {
+    Vec3 lo, hi;
+};
+
+RayBounds originBounds(const RayBatch& b) {
+    RayBounds r = {{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+    for (size_t i = 0; i < b.size(); i++) {
+        r.lo = {min(r.lo.x, b.ox[i]), min(r.lo.y, b.oy[i]), min(r.lo.z, b.oz[i])};
+        r.hi = {max(r.hi.x, b.ox[i]), max(r.hi.y, b.oy[i]), max(r.hi.z, b.oz[i])};
+    }
+    return r;
+}
+
+// Quantizes v within [lo, hi] to `bits` bits
+uint64_t quantize(double v, double lo, double hi, int bits) {
+    double cells = double(1 << bits);
+    double q = (hi > lo) ? (v - lo) / (hi - lo) * cells : 0;
+    return uint64_t(min(max(q, 0.0), cells - 1));
+}
+
+// Sort key: direction octant, then a 30-bit Morton code of the origin, then an
+// 18-bit Morton code of the direction, so rays that start close together and head
+// the same way end up adjacent
+uint64_t rayKey(const RayBatch& b, size_t i, const RayBounds& box) {
+    uint64_t origin = expandBits10(quantize(b.ox[i], box.lo.x, box.hi.x, 10))
+                    | expandBits10(quantize(b.oy[i], box.lo.y, box.hi.y, 10)) << 1
+                    | expandBits10(quantize(b.oz[i], box.lo.z, box.hi.z, 10)) << 2;
+    uint64_t dir = expandBits10(quantize(b.dx[i], -1, 1, 6))
+                 | expandBits10(quantize(b.dy[i], -1, 1, 6)) << 1
+                 | expandBits10(quantize(b.dz[i], -1, 1, 6)) << 2;
+    return uint64_t(rayOctant(b.dx[i], b.dy[i], b.dz[i])) << 48 | origin << 18 | dir;
+}
+
+const int RAY_KEY_BITS = 51;
+
+// Scratch for sortRays, kept so repeated sorts do not reallocate
+struct RaySortBuffers {
+    RayBatch sorted;
+    vector<uint64_t> keys, keysTmp;
+    vector<uint32_t> order, orderTmp;
+};
+
+// Stable LSD radix sort of (key, index) pairs, 11 bits per pass
+void radixSortKeys(RaySortBuffers& sb, int keyBits) {
+    const int DIGIT_BITS = 11, BUCKETS = 1 << DIGIT_BITS;
+    size_t n = sb.keys.size();
+    sb.keysTmp.resize(n);
+    sb.orderTmp.resize(n);
+    vector<size_t> counts(BUCKETS);
+    for (int shift = 0; shift < keyBits; shift += DIGIT_BITS) {
+        fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n; i++) counts[(sb.keys[i] >> shift) & (BUCKETS - 1)]++;
+        size_t sum = 0;
+        for (size_t& c : counts) { size_t k = c; c = sum; sum += k; }
+        for (size_t i = 0; i < n; i++) {
+            size_t dst = counts[(sb.keys[i] >> shift) & (BUCKETS - 1)]++;
+            sb.keysTmp[dst] = sb.keys[i];
+            sb.orderTmp[dst] = sb.order[i];
+        }
+        swap(sb.keys, sb.keysTmp);
+        swap(sb.order, sb.orderTmp);
+    }
+}
+
+// Reorders wave by rayKey; the sorted copy is built in sb.sorted and swapped in
+void sortRays(RayBatch& wave, RaySortBuffers& sb) {
+    RayBounds box = originBounds(wave);
+    size_t n = wave.size();
+    sb.keys.resize(n);
+    sb.order.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        sb.keys[i] = rayKey(wave, i, box);
+        sb.order[i] = i;
+    }
+    radixSortKeys(sb, RAY_KEY_BITS);
+    sb.sorted.gather(wave, sb.order);
+    swap(wave, sb.sorted);
+}
+
+// Coherence probe. An acceleration structure's top levels are shared by rays that
+// start in the same region and point the same way, so we track (origin cell, octant)
+// in a small LRU cache the way a traversal would find its upper nodes cached.
+const int COHERENCE_GRID_BITS = 7;   // 128^3 cells over the scene
+const int COHERENCE_CACHE = 32;
+
+struct CoherenceCache {
+    uint32_t entries[COHERENCE_CACHE];
+    int used = 0;
+    long long lookups = 0, hits = 0;
+
+    void touch(uint32_t key) {
+        lookups++;
+        int i = 0;
+        while (i < used && entries[i] != key) i++;
+        if (i < used) hits++;
+        else if (used < COHERENCE_CACHE) i = used++;
+        else i = COHERENCE_CACHE - 1;
+        for (; i > 0; i--) entries[i] = entries[i - 1];   // move to front
+        entries[0] = key;
+    }
+};
+
+void probeCoherence(const RayBatch& b, CoherenceCache& cache) {
+    const double lo = -6, hi = 6;   // scene extent
+    for (size_t i = 0; i < b.size(); i++) {
+        uint32_t cell = quantize(b.ox[i], lo, hi, COHERENCE_GRID_BITS)
+                      | quantize(b.oy[i], lo, hi, COHERENCE_GRID_BITS) << COHERENCE_GRID_BITS
+                      | quantize(b.oz[i], lo, hi, COHERENCE_GRID_BITS) << 2 * COHERENCE_GRID_BITS;
+        cache.touch(cell << 3 | rayOctant(b.dx[i], b.dy[i], b.dz[i]));
+    }
+}
+
+// Current wave plus one child queue per chunk; kept across frames so storage is reused
+struct Wavefront {
+    RayBatch wave;
+    vector<RayBatch> queues;
+    long long rays = 0;
+    int waves = 0;
+
+    bool sortSecondary = false;   // reorder every wave after the primaries by rayKey
+    RaySortBuffers sortBuffers;
+    double sortSeconds = 0;
+    CoherenceCache coherence;     // secondary waves only
+};
+
+// Loops intersect -> shade -> accumulate over whole waves until no segments remain.
+// Intersect and shade run in parallel chunks; each chunk queues its children
+// separately and the queues are joined in chunk order, so results are deterministic.
+void traceWavefront(Wavefront& wf, vector<Vec3>& frame) {
+    size_t threads = max(1u, thread::hardware_concurrency());
+    RayBatch& wave = wf.wave;
+    vector<RayBatch>& queues = wf.queues;
+    queues.resize(threads);
+    while (wave.size() > 0) {
+        if (wf.waves > 0) {
+            if (wf.sortSecondary) {
+                auto t0 = chrono::steady_clock::now();
+                sortRays(wave, wf.sortBuffers);
+                wf.sortSeconds += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+            }
+            probeCoherence(wave, wf.coherence);
+        }
+
+        size_t n = wave.size();
+        size_t chunks = min(threads, max<size_t>(1, n / 4096));
+        wave.t.resize(n);
+        wave.lr.resize(n); wave.lg.resize(n); wave.lb.resize(n);
+
+        parallelRanges(n, chunks, [&](size_t begin, size_t end, size_t c) {
+            intersectBatch(wave, begin, end);
+            queues[c].clear();
+            shadeBatch(wave, begin, end, queues[c]);
+        });
+
+        for (size_t i = 0; i < n; i++) {
+            Vec3& px = frame[wave.pixel[i]];
+            px = add(px, {wave.lr[i], wave.lg[i], wave.lb[i]});
+        }
+        wf.rays += n;
+        wf.waves++;
+
+        wave.clear();
+        for (size_t c = 0; c < chunks; c++) wave.append(queues[c]);
+    }
+}
+
 int main() {
     Vec3 camera = {0,0,0};
     Vec3 dir = normalize({0,0,-1});
+    const int DEPTH = 3;
 
-    Vec3 color = trace(camera, dir, 3);
+    Wavefront wf;
+    vector<Vec3> color(1, {0,0,0});
+    wf.wave.push(camera, dir, 1.0, 0, DEPTH);
+    traceWavefront(wf, color);
 
     cout << "Final color: ("
-         << color.x << ", "
-         << color.y << ", "
-         << color.z << ")\n";
+         << color[0].x << ", "
+         << color[0].y << ", "
+         << color[0].z << ")\n";
+
+    // Full frame: wavefront against the recursive reference, with secondary rays in
+    // spawn order and sorted. The second pass of each mode reuses the batch and queue
+    // storage, which is the steady state across frames.
+    const int W = 512, H = 512, FRAME_DEPTH = 8;
+    vector<Vec3> frames[2];
+    for (int sorted = 0; sorted < 2; sorted++) {
+        vector<Vec3>& frame = frames[sorted];
+        double waveSec = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            auto t0 = chrono::steady_clock::now();
+            frame.assign(W*H, {0,0,0});
+            wf.rays = wf.waves = 0;
+            wf.sortSecondary = sorted;
+            wf.sortSeconds = 0;
+            wf.coherence = CoherenceCache();
+            for (int y = 0; y < H; y++)
+                for (int x = 0; x < W; x++)
+                    wf.wave.push(camera, normalize({(x + 0.5)/W - 0.5, (y + 0.5)/H - 0.5, -1}), 1.0, y*W + x, FRAME_DEPTH);
+            traceWavefront(wf, frame);
+            waveSec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        }
+        cout << (sorted ? "Wavefront, sorted:   " : "Wavefront, unsorted: ") << wf.rays << " rays in "
+             << wf.waves << " waves, " << wf.rays / waveSec / 1e6 << " Mrays/s (" << waveSec*1e3
+             << " ms, sorting " << wf.sortSeconds*1e3 << " ms); secondary cell-cache hit rate "
+             << 100.0 * wf.coherence.hits / max(1LL, wf.coherence.lookups) << "%\n";
+    }
+
+    auto t0 = chrono::steady_clock::now();
+    double maxDiff = 0;
+    for (int y = 0; y < H; y++) {
+        for (int x = 0; x < W; x++) {
+            Vec3 ref = trace(camera, normalize({(x + 0.5)/W - 0.5, (y + 0.5)/H - 0.5, -1}), FRAME_DEPTH);
+            for (const vector<Vec3>& frame : frames) {
+                Vec3 d = subtract(ref, frame[y*W + x]);
+                maxDiff = max(maxDiff, max(fabs(d.x), max(fabs(d.y), fabs(d.z))));
+            }
+        }
+    }
+    double recSec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << "Recursive: " << recSec*1e3 << " ms; max difference " << maxDiff << "\n";
+
+    // Stochastic mode against the full tree on the same frame and depth
+    const int SPP = 64;
+    gRaysCast = 0;
+    t0 = chrono::steady_clock::now();
+    vector<Vec3> full(W*H);
+    for (int y = 0; y < H; y++)
+        for (int x = 0; x < W; x++)
+            full[y*W + x] = trace(camera, normalize({(x + 0.5)/W - 0.5, (y + 0.5)/H - 0.5, -1}), FRAME_DEPTH);
+    long long fullRays = gRaysCast;
+    double fullSec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+    gRaysCast = 0;
+    t0 = chrono::steady_clock::now();
+    double sumErr = 0, meanSigned = 0;
+    for (int y = 0; y < H; y++) {
+        for (int x = 0; x < W; x++) {
+            Rng rng = {uint64_t(y*W + x) * 0x9E3779B97F4A7C15ULL + 1};
+            Vec3 D = normalize({(x + 0.5)/W - 0.5, (y + 0.5)/H - 0.5, -1});
+            Vec3 sum = {0,0,0};
+            for (int s = 0; s < SPP; s++) sum = add(sum, traceStochastic(camera, D, FRAME_DEPTH, 1.0, rng));
+            Vec3 d = subtract(scale(sum, 1.0/SPP), full[y*W + x]);
+            sumErr += (fabs(d.x) + fabs(d.y) + fabs(d.z)) / 3;
+            meanSigned += (d.x + d.y + d.z) / 3;
+        }
+    }
+    double stochSec = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << "Full tree: " << double(fullRays) / (W*H) << " rays/sample, " << fullSec*1e3 << " ms\n"
+         << "Stochastic (" << SPP << " spp): " << double(gRaysCast) / (W*H*SPP) << " rays/sample, "
+         << stochSec*1e3 << " ms; mean abs error " << sumErr / (W*H)
+         << ", mean signed error " << meanSigned / (W*H) << "\n";
 }
@@ -1,5 +1,11 @@
 #include <iostream>
 #include <cmath>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 /* =======================
@@ -80,6 +86,170 @@ Vec3 lambert(
     return albedo * (NdotL / PI);
 }
 
+/* =======================
+   BATCH SHADING (SoA)
+   =======================
+   lambertBatch() shades count samples read from structure-of-arrays
+   float streams, 8 per iteration with AVX2 and one at a time in the
+   tail (or everywhere without AVX2). Pass unitVectors = true when every
+   N and L is already unit length to skip the per-sample normalization;
+   otherwise both are normalized as lambert() does, zero staying zero.
+   main() checks the result against lambert() to 1e-6 absolute.
+*/
+struct LambertInputs {
+    const float *nx, *ny, *nz;
+    const float *lx, *ly, *lz;
+    const float *albedoR, *albedoG, *albedoB;
+};
+
+struct ColorOutputs {
+    float *r, *g, *b;
+};
+
+template <bool Normalize>
+void lambertSample(const LambertInputs& in, const ColorOutputs& out, size_t i) {
+    float nx = in.nx[i], ny = in.ny[i], nz = in.nz[i];
+    float lx = in.lx[i], ly = in.ly[i], lz = in.lz[i];
+    float NdotL = nx * lx + ny * ly + nz * lz;
+    if (Normalize) {
+        float nn = nx * nx + ny * ny + nz * nz;
+        float ll = lx * lx + ly * ly + lz * lz;
+        NdotL = (nn > 0.0f && ll > 0.0f) ? NdotL / sqrt(nn * ll) : 0.0f;
+    }
+    float w = max(NdotL, 0.0f) * float(1.0 / PI);
+    out.r[i] = in.albedoR[i] * w;
+    out.g[i] = in.albedoG[i] * w;
+    out.b[i] = in.albedoB[i] * w;
+}
+
+#if defined(__AVX2__)
+static inline __m256 madd(__m256 a, __m256 b, __m256 c) {
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+// 1 / |v| from the squared length by rsqrt and one Newton step; 0 for v = 0
+static inline __m256 invLength8(__m256 len2) {
+    __m256 r = _mm256_rsqrt_ps(len2);
+    __m256 half = _mm256_mul_ps(_mm256_set1_ps(0.5f), len2);
+    r = _mm256_mul_ps(r, _mm256_sub_ps(_mm256_set1_ps(1.5f), _mm256_mul_ps(half, _mm256_mul_ps(r, r))));
+    return _mm256_and_ps(r, _mm256_cmp_ps(len2, _mm256_setzero_ps(), _CMP_GT_OQ));
+}
+#endif
+
+template <bool Normalize>
+void lambertKernel(const LambertInputs& in, const ColorOutputs& out, size_t count) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256 zero = _mm256_setzero_ps();
+    __m256 invPi = _mm256_set1_ps(float(1.0 / PI));
+    for (; i + 8 <= count; i += 8) {
+        __m256 nx = _mm256_loadu_ps(in.nx + i), ny = _mm256_loadu_ps(in.ny + i), nz = _mm256_loadu_ps(in.nz + i);
+        __m256 lx = _mm256_loadu_ps(in.lx + i), ly = _mm256_loadu_ps(in.ly + i), lz = _mm256_loadu_ps(in.lz + i);
+        __m256 NdotL = madd(nx, lx, madd(ny, ly, _mm256_mul_ps(nz, lz)));
+        if (Normalize) {
+            __m256 nn = madd(nx, nx, madd(ny, ny, _mm256_mul_ps(nz, nz)));
+            __m256 ll = madd(lx, lx, madd(ly, ly, _mm256_mul_ps(lz, lz)));
+            NdotL = _mm256_mul_ps(NdotL, _mm256_mul_ps(invLength8(nn), invLength8(ll)));
+        }
+        __m256 w = _mm256_mul_ps(_mm256_max_ps(NdotL, zero), invPi);
+        _mm256_storeu_ps(out.r + i, _mm256_mul_ps(_mm256_loadu_ps(in.albedoR + i), w));
+        _mm256_storeu_ps(out.g + i, _mm256_mul_ps(_mm256_loadu_ps(in.albedoG + i), w));
+        _mm256_storeu_ps(out.b + i, _mm256_mul_ps(_mm256_loadu_ps(in.albedoB + i), w));
+    }
+#endif
+    for (; i < count; i++)
+        lambertSample<Normalize>(in, out, i);
+}
+
+void lambertBatch(const LambertInputs& in, const ColorOutputs& out, size_t count, bool unitVectors) {
+    if (unitVectors) lambertKernel<false>(in, out, count);
+    else lambertKernel<true>(in, out, count);
+}
+
+/* =======================
+   BATCH CHECKS
+   ======================= */
+struct Rng {
+    uint64_t state;
+
+    double next() {   // uniform in [0, 1)
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (state >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+// SoA buffers for one batch; the unit* streams hold N and L pre-normalized
+struct LambertBuffers {
+    vector<float> nx, ny, nz, lx, ly, lz, ar, ag, ab;
+    vector<float> unx, uny, unz, ulx, uly, ulz;
+    vector<float> r, g, b;
+
+    explicit LambertBuffers(size_t n)
+        : nx(n), ny(n), nz(n), lx(n), ly(n), lz(n), ar(n), ag(n), ab(n),
+          unx(n), uny(n), unz(n), ulx(n), uly(n), ulz(n), r(n), g(n), b(n) {}
+};
+
+// Compares lambertBatch() in both modes against lambert() and times all
+// three; returns false if the documented tolerance is exceeded
+bool checkBatch() {
+    const size_t COUNT = (1 << 20) + 5;   // odd size exercises the scalar tail
+    LambertBuffers buf(COUNT);
+    Rng rng{2024};
+    for (size_t i = 0; i < COUNT; i++) {
+        Vec3 n = {rng.next() * 4 - 2, rng.next() * 4 - 2, rng.next() * 4 - 2};
+        Vec3 l = {rng.next() * 4 - 2, rng.next() * 4 - 2, rng.next() * 4 - 2};
+        Vec3 un = normalize(n), ul = normalize(l);
+        buf.nx[i] = float(n.x); buf.ny[i] = float(n.y); buf.nz[i] = float(n.z);
+        buf.lx[i] = float(l.x); buf.ly[i] = float(l.y); buf.lz[i] = float(l.z);
+        buf.unx[i] = float(un.x); buf.uny[i] = float(un.y); buf.unz[i] = float(un.z);
+        buf.ulx[i] = float(ul.x); buf.uly[i] = float(ul.y); buf.ulz[i] = float(ul.z);
+        buf.ar[i] = float(rng.next()); buf.ag[i] = float(rng.next()); buf.ab[i] = float(rng.next());
+    }
+
+    LambertInputs raw = {buf.nx.data(), buf.ny.data(), buf.nz.data(),
+                         buf.lx.data(), buf.ly.data(), buf.lz.data(),
+                         buf.ar.data(), buf.ag.data(), buf.ab.data()};
+    LambertInputs unit = {buf.unx.data(), buf.uny.data(), buf.unz.data(),
+                          buf.ulx.data(), buf.uly.data(), buf.ulz.data(),
+                          buf.ar.data(), buf.ag.data(), buf.ab.data()};
+    ColorOutputs out = {buf.r.data(), buf.g.data(), buf.b.data()};
+
+    Vec3 sink = {0, 0, 0};
+    vector<Vec3> ref(COUNT);
+    auto t0 = chrono::steady_clock::now();
+    for (size_t i = 0; i < COUNT; i++) {
+        ref[i] = lambert({buf.nx[i], buf.ny[i], buf.nz[i]}, {buf.lx[i], buf.ly[i], buf.lz[i]},
+                         {buf.ar[i], buf.ag[i], buf.ab[i]});
+        sink = sink + ref[i];
+    }
+    auto t1 = chrono::steady_clock::now();
+
+    double worst = 0.0, seconds[2];
+    for (int unitMode = 0; unitMode < 2; unitMode++) {
+        auto b0 = chrono::steady_clock::now();
+        lambertBatch(unitMode ? unit : raw, out, COUNT, unitMode == 1);
+        seconds[unitMode] = chrono::duration<double>(chrono::steady_clock::now() - b0).count();
+        for (size_t i = 0; i < COUNT; i++) {
+            worst = max(worst, fabs(buf.r[i] - ref[i].x));
+            worst = max(worst, fabs(buf.g[i] - ref[i].y));
+            worst = max(worst, fabs(buf.b[i] - ref[i].z));
+        }
+    }
+
+    double scalarNs = chrono::duration<double, nano>(t1 - t0).count() / COUNT;
+    bool ok = worst <= 1e-6;
+    cout << "lambertBatch max abs error = " << worst
+         << (ok ? " (within tolerance)" : " (OUT OF TOLERANCE)") << "\n";
+    cout << "lambert " << scalarNs << " ns, batch " << seconds[0] * 1e9 / COUNT
+         << " ns, batch (unit vectors) " << seconds[1] * 1e9 / COUNT
+         << " ns per sample (checksum " << sink.x + sink.y + sink.z << ")\n";
+    return ok;
+}
+
 /* =======================
    MAIN
    ======================= */
@@ -100,5 +270,5 @@ int main() {
          << color.y << ", "
          << color.z << ")\n";
 
-    return 0;
+    return checkBatch() ? 0 : 1;
 }
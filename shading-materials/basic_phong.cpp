@@ -1,5 +1,12 @@
 #include <iostream>
 #include <cmath>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 /* =======================
@@ -85,6 +92,370 @@ Vec3 phong(
     return (ambient + diffuse + specular) * 1.0;
 }
 
+/* =======================
+   FAST SPECULAR EXPONENT
+   =======================
+   specPow(x, n) replaces pow(x, n) for x in [0, 1]:
+     - Integral n up to 1024, the usual Phong shininess, is raised by
+       repeated squaring: at most 2 * 10 multiplies, exact to rounding.
+     - Other n go through exp2(n * log2(x)) with short polynomials:
+         log2: x = m * 2^e with m in [sqrt(1/2), sqrt(2)) read from the
+               bits, t = (m - 1) / (m + 1), log2(m) = 2/ln2 * (t + t^3/3
+               + ... + t^11/11); |t| < 0.172 bounds the truncation by 3e-11.
+         exp2: y = i + f with f in [-1/2, 1/2], 2^f by a degree-8 Taylor
+               polynomial in f * ln2, scaled by 2^i through the exponent.
+   Error bound relative to pow(x, n), checked by checkSpecPow() in main
+   over x in [0, 1] and n in [1, 256] (results below 1e-300 excepted):
+     integral n: 1e-14        other n: 1e-8 (the log2 error scales with n)
+*/
+double specPow(double x, double n) {
+    if (x <= 0.0) return n == 0.0 ? 1.0 : 0.0;
+
+    if (n == floor(n) && n >= 0.0 && n <= 1024.0) {
+        double r = 1.0;
+        for (unsigned k = unsigned(n); k; k >>= 1) {
+            if (k & 1) r *= x;
+            x *= x;
+        }
+        return r;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof bits);
+    int e = int(bits >> 52) - 1023;
+    bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m;
+    memcpy(&m, &bits, sizeof m);
+    if (m > 1.4142135623730951) { m *= 0.5; e++; }
+
+    double t = (m - 1.0) / (m + 1.0);
+    double t2 = t * t;
+    double lg = t * (2.8853900817779268 + t2 * (0.9617966939259756 +
+                t2 * (0.5770780163555853 + t2 * (0.4121985831111324 +
+                t2 * (0.3205988979753252 + t2 * 0.2623081892525388)))));
+
+    double y = n * (lg + e);
+    if (y < -1022.0) return 0.0;
+    double i = floor(y + 0.5);
+    double f = (y - i) * 0.6931471805599453;
+    double p = 1.0 + f * (1.0 + f * (1.0 / 2 + f * (1.0 / 6 + f * (1.0 / 24 +
+               f * (1.0 / 120 + f * (1.0 / 720 + f * (1.0 / 5040 +
+               f * (1.0 / 40320))))))));
+
+    uint64_t scale = uint64_t(int64_t(i) + 1023) << 52;
+    double s;
+    memcpy(&s, &scale, sizeof s);
+    return p * s;
+}
+
+/* =======================
+   FAST PHONG SHADING
+   ======================= */
+Vec3 phongFast(
+    Vec3 N,
+    Vec3 L,
+    Vec3 V,
+    Vec3 /*lightColor*/,   // unused, as in phong()
+    Vec3 ka,
+    Vec3 kd,
+    Vec3 ks,
+    double shininess
+) {
+    N = normalize(N);
+    L = normalize(L);
+    V = normalize(V);
+
+    double diff = max(0.0, dot(N, L));
+    Vec3 R = reflect(-L, N);
+    double spec = specPow(max(0.0, dot(R, V)), shininess);
+
+    return ka + kd * diff + ks * spec;
+}
+
+/* =======================
+   BATCH SHADING (SoA)
+   =======================
+   phongBatch() shades count samples read from structure-of-arrays
+   float streams, 8 per iteration with AVX2 and one at a time in the
+   tail (or everywhere without AVX2). Pass unitVectors = true when every
+   N, L and V is already unit length to skip the per-sample
+   normalization. R is never formed: R.V = 2 (N.L)(N.V) - L.V.
+   Per-sample shininess goes through the exp2/log2 polynomials of
+   specPow() cut to float precision. The few-ulp float rounding of R.V
+   is multiplied by the exponent in x^n, so main() checks against
+   phong() to 2e-4 absolute for shininess up to 256.
+*/
+struct PhongInputs {
+    const float *nx, *ny, *nz;
+    const float *lx, *ly, *lz;
+    const float *vx, *vy, *vz;
+    const float *kaR, *kaG, *kaB;
+    const float *kdR, *kdG, *kdB;
+    const float *ksR, *ksG, *ksB;
+    const float *shininess;
+};
+
+struct ColorOutputs {
+    float *r, *g, *b;
+};
+
+template <bool Normalize>
+void phongSample(const PhongInputs& in, const ColorOutputs& out, size_t i) {
+    float nx = in.nx[i], ny = in.ny[i], nz = in.nz[i];
+    float lx = in.lx[i], ly = in.ly[i], lz = in.lz[i];
+    float vx = in.vx[i], vy = in.vy[i], vz = in.vz[i];
+    float NdotL = nx * lx + ny * ly + nz * lz;
+    float NdotV = nx * vx + ny * vy + nz * vz;
+    float LdotV = lx * vx + ly * vy + lz * vz;
+    if (Normalize) {
+        float nn = nx * nx + ny * ny + nz * nz;
+        float ll = lx * lx + ly * ly + lz * lz;
+        float vv = vx * vx + vy * vy + vz * vz;
+        float iN = nn > 0.0f ? 1.0f / sqrt(nn) : 0.0f;
+        float iL = ll > 0.0f ? 1.0f / sqrt(ll) : 0.0f;
+        float iV = vv > 0.0f ? 1.0f / sqrt(vv) : 0.0f;
+        NdotL *= iN * iL;
+        NdotV *= iN * iV;
+        LdotV *= iL * iV;
+    }
+    float diff = max(NdotL, 0.0f);
+    float spec = float(specPow(max(2.0f * NdotL * NdotV - LdotV, 0.0f), in.shininess[i]));
+    out.r[i] = in.kaR[i] + in.kdR[i] * diff + in.ksR[i] * spec;
+    out.g[i] = in.kaG[i] + in.kdG[i] * diff + in.ksG[i] * spec;
+    out.b[i] = in.kaB[i] + in.kdB[i] * diff + in.ksB[i] * spec;
+}
+
+#if defined(__AVX2__)
+static inline __m256 madd(__m256 a, __m256 b, __m256 c) {
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+// 1 / |v| from the squared length by rsqrt and one Newton step; 0 for v = 0
+static inline __m256 invLength8(__m256 len2) {
+    __m256 r = _mm256_rsqrt_ps(len2);
+    __m256 half = _mm256_mul_ps(_mm256_set1_ps(0.5f), len2);
+    r = _mm256_mul_ps(r, _mm256_sub_ps(_mm256_set1_ps(1.5f), _mm256_mul_ps(half, _mm256_mul_ps(r, r))));
+    return _mm256_and_ps(r, _mm256_cmp_ps(len2, _mm256_setzero_ps(), _CMP_GT_OQ));
+}
+
+// x^n per lane for x in [0, 1]; results below 2^-126 (and x = 0) flush to 0
+static inline __m256 specPow8(__m256 x, __m256 n) {
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256i bits = _mm256_castps_si256(x);
+    __m256i e = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)),
+                                                   _mm256_set1_epi32(0x3F800000)));
+    __m256 big = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+    m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), big);
+    __m256 ef = _mm256_add_ps(_mm256_cvtepi32_ps(e), _mm256_and_ps(big, one));
+
+    __m256 t = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+    __m256 t2 = _mm256_mul_ps(t, t);
+    __m256 lg = madd(t2, _mm256_set1_ps(0.41219858f), _mm256_set1_ps(0.57707802f));
+    lg = madd(t2, lg, _mm256_set1_ps(0.96179669f));
+    lg = madd(t2, lg, _mm256_set1_ps(2.88539008f));
+    __m256 y = _mm256_mul_ps(n, madd(t, lg, ef));
+
+    __m256 i = _mm256_round_ps(y, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 f = _mm256_mul_ps(_mm256_sub_ps(y, i), _mm256_set1_ps(0.69314718f));
+    __m256 p = madd(f, _mm256_set1_ps(1.0f / 720), _mm256_set1_ps(1.0f / 120));
+    p = madd(f, p, _mm256_set1_ps(1.0f / 24));
+    p = madd(f, p, _mm256_set1_ps(1.0f / 6));
+    p = madd(f, p, _mm256_set1_ps(0.5f));
+    p = madd(f, p, one);
+    p = madd(f, p, one);
+
+    __m256i scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(i), _mm256_set1_epi32(127)), 23);
+    __m256 r = _mm256_mul_ps(p, _mm256_castsi256_ps(scale));
+    return _mm256_and_ps(r, _mm256_cmp_ps(y, _mm256_set1_ps(-126.0f), _CMP_GE_OQ));
+}
+#endif
+
+template <bool Normalize>
+void phongKernel(const PhongInputs& in, const ColorOutputs& out, size_t count) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256 zero = _mm256_setzero_ps();
+    for (; i + 8 <= count; i += 8) {
+        __m256 nx = _mm256_loadu_ps(in.nx + i), ny = _mm256_loadu_ps(in.ny + i), nz = _mm256_loadu_ps(in.nz + i);
+        __m256 lx = _mm256_loadu_ps(in.lx + i), ly = _mm256_loadu_ps(in.ly + i), lz = _mm256_loadu_ps(in.lz + i);
+        __m256 vx = _mm256_loadu_ps(in.vx + i), vy = _mm256_loadu_ps(in.vy + i), vz = _mm256_loadu_ps(in.vz + i);
+        __m256 NdotL = madd(nx, lx, madd(ny, ly, _mm256_mul_ps(nz, lz)));
+        __m256 NdotV = madd(nx, vx, madd(ny, vy, _mm256_mul_ps(nz, vz)));
+        __m256 LdotV = madd(lx, vx, madd(ly, vy, _mm256_mul_ps(lz, vz)));
+        if (Normalize) {
+            __m256 iN = invLength8(madd(nx, nx, madd(ny, ny, _mm256_mul_ps(nz, nz))));
+            __m256 iL = invLength8(madd(lx, lx, madd(ly, ly, _mm256_mul_ps(lz, lz))));
+            __m256 iV = invLength8(madd(vx, vx, madd(vy, vy, _mm256_mul_ps(vz, vz))));
+            NdotL = _mm256_mul_ps(NdotL, _mm256_mul_ps(iN, iL));
+            NdotV = _mm256_mul_ps(NdotV, _mm256_mul_ps(iN, iV));
+            LdotV = _mm256_mul_ps(LdotV, _mm256_mul_ps(iL, iV));
+        }
+        __m256 diff = _mm256_max_ps(NdotL, zero);
+        __m256 RdotV = _mm256_sub_ps(_mm256_mul_ps(_mm256_add_ps(NdotL, NdotL), NdotV), LdotV);
+        __m256 spec = specPow8(_mm256_max_ps(RdotV, zero), _mm256_loadu_ps(in.shininess + i));
+
+        _mm256_storeu_ps(out.r + i, madd(_mm256_loadu_ps(in.ksR + i), spec,
+                                         madd(_mm256_loadu_ps(in.kdR + i), diff, _mm256_loadu_ps(in.kaR + i))));
+        _mm256_storeu_ps(out.g + i, madd(_mm256_loadu_ps(in.ksG + i), spec,
+                                         madd(_mm256_loadu_ps(in.kdG + i), diff, _mm256_loadu_ps(in.kaG + i))));
+        _mm256_storeu_ps(out.b + i, madd(_mm256_loadu_ps(in.ksB + i), spec,
+                                         madd(_mm256_loadu_ps(in.kdB + i), diff, _mm256_loadu_ps(in.kaB + i))));
+    }
+#endif
+    for (; i < count; i++)
+        phongSample<Normalize>(in, out, i);
+}
+
+void phongBatch(const PhongInputs& in, const ColorOutputs& out, size_t count, bool unitVectors) {
+    if (unitVectors) phongKernel<false>(in, out, count);
+    else phongKernel<true>(in, out, count);
+}
+
+/* =======================
+   FAST PATH CHECKS
+   ======================= */
+struct Rng {
+    uint64_t state;
+
+    double next() {   // uniform in [0, 1)
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (state >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+// Sweeps specPow() against pow() and times phong() against phongFast();
+// returns false if the documented bound is exceeded
+bool checkSpecPow() {
+    double worstInt = 0.0, worstFrac = 0.0;
+    for (int n = 4; n <= 1024; n++)
+        for (int i = 0; i <= 4096; i++) {
+            double x = i / 4096.0;
+            double exponent = n / 4.0;
+            double ref = pow(x, exponent);
+            if (ref < 1e-300) continue;
+            double err = fabs(specPow(x, exponent) - ref) / ref;
+            double& worst = (n % 4 == 0) ? worstInt : worstFrac;
+            worst = max(worst, err);
+        }
+
+    const int COUNT = 1 << 20;
+    vector<Vec3> normals(COUNT);
+    Rng rng{12345};
+    for (Vec3& n : normals)
+        n = {rng.next() * 2 - 1, rng.next() * 2 - 1, rng.next() * 2 + 1};
+
+    Vec3 L = {1, 1, 1}, V = {0, 0, 1}, one = {1, 1, 1};
+    Vec3 ka = {0.1, 0.1, 0.1}, kd = {0.7, 0.2, 0.2};
+    Vec3 sink = {0, 0, 0};
+    auto t0 = chrono::steady_clock::now();
+    for (const Vec3& n : normals)
+        sink = sink + phong(n, L, V, one, ka, kd, one, 32.0);
+    auto t1 = chrono::steady_clock::now();
+    for (const Vec3& n : normals)
+        sink = sink + phongFast(n, L, V, one, ka, kd, one, 32.0);
+    auto t2 = chrono::steady_clock::now();
+
+    double refNs = chrono::duration<double, nano>(t1 - t0).count() / COUNT;
+    double fastNs = chrono::duration<double, nano>(t2 - t1).count() / COUNT;
+    bool ok = worstInt <= 1e-14 && worstFrac <= 1e-8;
+
+    cout << "specPow max rel error = " << worstInt << " (integral n), "
+         << worstFrac << " (other n)"
+         << (ok ? " (within bounds)" : " (OUT OF BOUNDS)") << "\n";
+    cout << "phong " << refNs << " ns, phongFast " << fastNs
+         << " ns per sample (checksum " << sink.x + sink.y + sink.z << ")\n";
+    return ok;
+}
+
+// SoA streams for one batch, three per vector or color; unit* hold N, L
+// and V pre-normalized
+struct PhongBuffers {
+    vector<float> n[3], l[3], v[3], ka[3], kd[3], ks[3], shininess;
+    vector<float> un[3], ul[3], uv[3], out[3];
+
+    explicit PhongBuffers(size_t count) : shininess(count) {
+        for (int c = 0; c < 3; c++)
+            for (vector<float>* s : {n, l, v, ka, kd, ks, un, ul, uv, out})
+                s[c].resize(count);
+    }
+
+    PhongInputs inputs(bool unit) {
+        vector<float>* N = unit ? un : n;
+        vector<float>* L = unit ? ul : l;
+        vector<float>* V = unit ? uv : v;
+        return {N[0].data(), N[1].data(), N[2].data(),
+                L[0].data(), L[1].data(), L[2].data(),
+                V[0].data(), V[1].data(), V[2].data(),
+                ka[0].data(), ka[1].data(), ka[2].data(),
+                kd[0].data(), kd[1].data(), kd[2].data(),
+                ks[0].data(), ks[1].data(), ks[2].data(),
+                shininess.data()};
+    }
+
+    Vec3 at(const vector<float>* s, size_t i) const { return {s[0][i], s[1][i], s[2][i]}; }
+};
+
+// Compares phongBatch() in both modes against phong() and times all
+// three; returns false if the documented tolerance is exceeded
+bool checkBatch() {
+    const size_t COUNT = (1 << 20) + 5;   // odd size exercises the scalar tail
+    PhongBuffers buf(COUNT);
+    Rng rng{2024};
+    for (size_t i = 0; i < COUNT; i++) {
+        for (vector<float>* s : {buf.n, buf.l, buf.v}) {
+            Vec3 d = {rng.next() * 4 - 2, rng.next() * 4 - 2, rng.next() * 4 - 2};
+            Vec3 u = normalize(d);
+            vector<float>* us = s == buf.n ? buf.un : s == buf.l ? buf.ul : buf.uv;
+            s[0][i] = float(d.x); s[1][i] = float(d.y); s[2][i] = float(d.z);
+            us[0][i] = float(u.x); us[1][i] = float(u.y); us[2][i] = float(u.z);
+        }
+        for (int c = 0; c < 3; c++) {
+            buf.ka[c][i] = float(0.2 * rng.next());
+            buf.kd[c][i] = float(rng.next());
+            buf.ks[c][i] = float(rng.next());
+        }
+        buf.shininess[i] = float(1.0 + 255.0 * rng.next());
+    }
+
+    Vec3 sink = {0, 0, 0};
+    vector<Vec3> ref(COUNT);
+    Vec3 white = {1, 1, 1};
+    auto t0 = chrono::steady_clock::now();
+    for (size_t i = 0; i < COUNT; i++) {
+        ref[i] = phong(buf.at(buf.n, i), buf.at(buf.l, i), buf.at(buf.v, i), white,
+                       buf.at(buf.ka, i), buf.at(buf.kd, i), buf.at(buf.ks, i), buf.shininess[i]);
+        sink = sink + ref[i];
+    }
+    auto t1 = chrono::steady_clock::now();
+
+    double worst = 0.0, seconds[2];
+    ColorOutputs out = {buf.out[0].data(), buf.out[1].data(), buf.out[2].data()};
+    for (int unitMode = 0; unitMode < 2; unitMode++) {
+        auto b0 = chrono::steady_clock::now();
+        phongBatch(buf.inputs(unitMode == 1), out, COUNT, unitMode == 1);
+        seconds[unitMode] = chrono::duration<double>(chrono::steady_clock::now() - b0).count();
+        for (size_t i = 0; i < COUNT; i++) {
+            worst = max(worst, fabs(out.r[i] - ref[i].x));
+            worst = max(worst, fabs(out.g[i] - ref[i].y));
+            worst = max(worst, fabs(out.b[i] - ref[i].z));
+        }
+    }
+
+    double scalarNs = chrono::duration<double, nano>(t1 - t0).count() / COUNT;
+    bool ok = worst <= 2e-4;
+    cout << "phongBatch max abs error = " << worst
+         << (ok ? " (within tolerance)" : " (OUT OF TOLERANCE)") << "\n";
+    cout << "phong " << scalarNs << " ns, batch " << seconds[0] * 1e9 / COUNT
+         << " ns, batch (unit vectors) " << seconds[1] * 1e9 / COUNT
+         << " ns per sample (checksum " << sink.x + sink.y + sink.z << ")\n";
+    return ok;
+}
+
 /* =======================
    MAIN
    ======================= */
@@ -110,5 +481,13 @@ int main() {
          << color.y << ", "
          << color.z << ")\n";
 
-    return 0;
+    Vec3 fast = phongFast(N, L, V, lightColor, ka, kd, ks, shininess);
+    cout << "phongFast color = ("
+         << fast.x << ", "
+         << fast.y << ", "
+         << fast.z << ")\n";
+
+    bool ok = checkSpecPow();
+    ok &= checkBatch();
+    return ok ? 0 : 1;
 }
@@ -1,5 +1,11 @@
 #include <iostream>
 #include <cmath>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 /* =======================
@@ -128,6 +134,513 @@ Vec3 PBR(
     return (kD * albedo / PI + specular) * NdotL;
 }
 
+/* =======================
+   FAST PATH: BRDF TABLES
+   =======================
+   PBRFast() is a drop-in for PBR() that takes the per-sample
+   transcendental work out of the shader:
+     - Schlick's (1 - cos)^5 is a polynomial, m2 * m2 * m, which agrees
+       with pow() to rounding.
+     - Schlick-GGX G1(c) = c / q(c) with q(c) = c * (1 - k) + k, so D * G
+       over the 4 NdotV NdotL denominator folds into one division of
+       products of FMAs. (Tabulating G1 is both slower and, near c = 0,
+       up to 2% off.)
+   The split-sum DFG table (Karis 2013) stores the directional albedo
+   of the same BRDF as a scale A and bias B on F0, so that the specular
+   response to uniform incident radiance is F0 * A + B. ambientSpecular()
+   reads it with one bilinear fetch per term in place of a hemisphere
+   integral. Rows are spaced by sqrt(NdotV), which puts more of them
+   near grazing angles where A and B change fastest.
+
+   Error bounds, checked by checkFastPath() in main over random inputs
+   with roughness in [0.05, 1]:
+     PBRFast vs PBR:                 |diff| <= 1e-12 * max(1, |PBR|)
+     ambientSpecular vs integration: |diff| <= 2.5e-3
+*/
+const int DFG_SIZE = 32;    // sqrt(NdotV) x roughness samples of the DFG table
+const int DFG_SAMPLES = 4096;
+
+struct BRDFTables {
+    float dfgA[DFG_SIZE][DFG_SIZE];
+    float dfgB[DFG_SIZE][DFG_SIZE];
+};
+
+// (1 - cosTheta)^5 without pow()
+double schlickWeight(double cosTheta) {
+    double m = 1.0 - cosTheta;
+    double m2 = m * m;
+    return m2 * m2 * m;
+}
+
+// Bilinear fetch from a row-major [roughness][x] table whose samples
+// sit on the grid points 0, 1/(n-1), ..., 1 of both axes
+double sampleTable(const float* table, int nX, int nRough,
+                   double x, double roughness) {
+    double fc = min(max(x, 0.0), 1.0) * (nX - 1);
+    double fr = min(max(roughness, 0.0), 1.0) * (nRough - 1);
+    int ic = min(int(fc), nX - 2);
+    int ir = min(int(fr), nRough - 2);
+    double tc = fc - ic, tr = fr - ir;
+
+    const float* r0 = table + ir * nX + ic;
+    const float* r1 = r0 + nX;
+    double a = r0[0] + (r0[1] - r0[0]) * tc;
+    double b = r1[0] + (r1[1] - r1[0]) * tc;
+    return a + (b - a) * tr;
+}
+
+// Radical inverse in base 2, for the Hammersley point set
+double radicalInverse(uint32_t bits) {
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+    bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+    bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+    bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+    return bits * (1.0 / 4294967296.0);
+}
+
+// Split-sum scale and bias for one (NdotV, roughness), integrated with
+// GGX importance sampling in tangent space (N = +z). With pdf(L) =
+// D * NdotH / (4 * VdotH) the estimator of f_spec * NdotL / F is
+// G * VdotH / (NdotH * NdotV); G1(NdotV) / NdotV is written as
+// 1 / (NdotV * (1 - k) + k) so that NdotV = 0 stays finite.
+void integrateDFG(double NdotV, double roughness, int samples,
+                  double& A, double& B) {
+    Vec3 V = {sqrt(1.0 - NdotV * NdotV), 0.0, NdotV};
+    double a = roughness * roughness;
+    double r = roughness + 1.0;
+    double k = (r * r) / 8.0;
+
+    A = B = 0.0;
+    for (int i = 0; i < samples; i++) {
+        double u = (i + 0.5) / samples;
+        double v = radicalInverse(uint32_t(i));
+
+        double phi = 2.0 * PI * v;
+        double cosT = sqrt((1.0 - u) / (1.0 + (a * a - 1.0) * u));
+        double sinT = sqrt(1.0 - cosT * cosT);
+        Vec3 H = {sinT * cos(phi), sinT * sin(phi), cosT};
+
+        double VdotH = dot(V, H);
+        Vec3 L = H * (2.0 * VdotH) - V;
+        double NdotL = L.z;
+        if (NdotL <= 0.0 || VdotH <= 0.0) continue;
+
+        double vis = GeometrySchlickGGX(NdotL, roughness) * VdotH /
+                     (H.z * (NdotV * (1.0 - k) + k));
+        double Fc = schlickWeight(VdotH);
+        A += (1.0 - Fc) * vis;
+        B += Fc * vis;
+    }
+    A /= samples;
+    B /= samples;
+}
+
+void buildBRDFTables(BRDFTables& t) {
+    for (int ir = 0; ir < DFG_SIZE; ir++)
+        for (int ic = 0; ic < DFG_SIZE; ic++) {
+            double A, B;
+            double s = double(ic) / (DFG_SIZE - 1);
+            integrateDFG(s * s, double(ir) / (DFG_SIZE - 1),
+                         DFG_SAMPLES, A, B);
+            t.dfgA[ir][ic] = float(A);
+            t.dfgB[ir][ic] = float(B);
+        }
+}
+
+/* =======================
+   FAST PBR SHADING
+   ======================= */
+Vec3 PBRFast(
+    Vec3 N,
+    Vec3 V,
+    Vec3 L,
+    Vec3 albedo,
+    double metallic,
+    double roughness
+) {
+    N = normalize(N);
+    V = normalize(V);
+    L = normalize(L);
+
+    double NdotL = max(dot(N, L), 0.0);
+    if (NdotL == 0.0) return {0, 0, 0};
+
+    Vec3 H = normalize(V + L);
+    double NdotV = max(dot(N, V), 0.0);
+    double NdotH = max(dot(N, H), 0.0);
+    double w = schlickWeight(max(dot(H, V), 0.0));
+
+    double a = roughness * roughness;
+    double a2 = a * a;
+    double r = roughness + 1.0;
+    double k = (r * r) / 8.0;
+    double d = NdotH * NdotH * (a2 - 1.0) + 1.0;
+    double qV = NdotV * (1.0 - k) + k;
+    double qL = NdotL * (1.0 - k) + k;
+
+    // D * G1(NdotV) * G1(NdotL) / (4 NdotV NdotL + eps) in one division
+    double spec = a2 * NdotV * NdotL /
+                  (PI * d * d * qV * qL * (4.0 * NdotV * NdotL + 1e-5));
+
+    Vec3 F0 = Vec3{0.04, 0.04, 0.04} * (1.0 - metallic) + albedo * metallic;
+    Vec3 F = F0 + (Vec3{1, 1, 1} - F0) * w;
+    Vec3 kD = (Vec3{1, 1, 1} - F) * (1.0 - metallic);
+
+    return (kD * albedo * (1.0 / PI) + F * spec) * NdotL;
+}
+
+// Specular reflection of a uniform environment of radiance envColor
+Vec3 ambientSpecular(
+    const BRDFTables& t,
+    double NdotV,
+    double roughness,
+    Vec3 F0,
+    Vec3 envColor
+) {
+    double s = sqrt(max(NdotV, 0.0));
+    double A = sampleTable(&t.dfgA[0][0], DFG_SIZE, DFG_SIZE, s, roughness);
+    double B = sampleTable(&t.dfgB[0][0], DFG_SIZE, DFG_SIZE, s, roughness);
+    return envColor * (F0 * A + Vec3{B, B, B});
+}
+
+/* =======================
+   BATCH SHADING (SoA)
+   =======================
+   PBRBatch() shades count samples read from structure-of-arrays float
+   streams with the PBRFast() formulation, 8 per iteration with AVX2
+   and one at a time in the tail (or everywhere without AVX2). Pass
+   unitVectors = true when every N, V and L is already unit length to
+   skip their normalization; H is always normalized. In float,
+   1 - NdotH^2 cancels badly next to the GGX peak, so the D denominator
+   uses |N x H|^2 instead. main() checks against PBR() to 1e-4 relative
+   (absolute below 1) for roughness in [0.05, 1].
+*/
+struct PBRInputs {
+    const float *nx, *ny, *nz;
+    const float *vx, *vy, *vz;
+    const float *lx, *ly, *lz;
+    const float *albedoR, *albedoG, *albedoB;
+    const float *metallic, *roughness;
+};
+
+struct ColorOutputs {
+    float *r, *g, *b;
+};
+
+template <bool Normalize>
+void PBRSample(const PBRInputs& in, const ColorOutputs& out, size_t i) {
+    float nx = in.nx[i], ny = in.ny[i], nz = in.nz[i];
+    float vx = in.vx[i], vy = in.vy[i], vz = in.vz[i];
+    float lx = in.lx[i], ly = in.ly[i], lz = in.lz[i];
+    if (Normalize) {
+        float nn = nx * nx + ny * ny + nz * nz;
+        float vv = vx * vx + vy * vy + vz * vz;
+        float ll = lx * lx + ly * ly + lz * lz;
+        float iN = nn > 0.0f ? 1.0f / sqrt(nn) : 0.0f;
+        float iV = vv > 0.0f ? 1.0f / sqrt(vv) : 0.0f;
+        float iL = ll > 0.0f ? 1.0f / sqrt(ll) : 0.0f;
+        nx *= iN; ny *= iN; nz *= iN;
+        vx *= iV; vy *= iV; vz *= iV;
+        lx *= iL; ly *= iL; lz *= iL;
+    }
+    float hx = vx + lx, hy = vy + ly, hz = vz + lz;
+    float hh = hx * hx + hy * hy + hz * hz;
+    float iH = hh > 0.0f ? 1.0f / sqrt(hh) : 0.0f;
+    hx *= iH; hy *= iH; hz *= iH;
+
+    float NdotV = max(nx * vx + ny * vy + nz * vz, 0.0f);
+    float NdotL = max(nx * lx + ny * ly + nz * lz, 0.0f);
+    float NdotH = nx * hx + ny * hy + nz * hz;
+    float HdotV = max(hx * vx + hy * vy + hz * vz, 0.0f);
+    float cx = ny * hz - nz * hy, cy = nz * hx - nx * hz, cz = nx * hy - ny * hx;
+
+    float rough = in.roughness[i], metallic = in.metallic[i];
+    float a = rough * rough;
+    float a2 = a * a;
+    float k = (rough + 1.0f) * (rough + 1.0f) * 0.125f;
+    float d = NdotH > 0.0f ? cx * cx + cy * cy + cz * cz + NdotH * NdotH * a2 : 1.0f;
+    float qV = NdotV * (1.0f - k) + k;
+    float qL = NdotL * (1.0f - k) + k;
+    float spec = a2 * NdotV * NdotL /
+                 (float(PI) * d * d * qV * qL * (4.0f * NdotV * NdotL + 1e-5f));
+
+    float m = 1.0f - HdotV;
+    float w = m * m * m * m * m;
+    float albedo[3] = {in.albedoR[i], in.albedoG[i], in.albedoB[i]};
+    float* dst[3] = {out.r, out.g, out.b};
+    for (int c = 0; c < 3; c++) {
+        float F0 = 0.04f * (1.0f - metallic) + albedo[c] * metallic;
+        float F = F0 + (1.0f - F0) * w;
+        float kD = (1.0f - F) * (1.0f - metallic);
+        dst[c][i] = (kD * albedo[c] * float(1.0 / PI) + F * spec) * NdotL;
+    }
+}
+
+#if defined(__AVX2__)
+static inline __m256 madd(__m256 a, __m256 b, __m256 c) {
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+static inline __m256 dot8(__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz) {
+    return madd(ax, bx, madd(ay, by, _mm256_mul_ps(az, bz)));
+}
+
+// Scales (x, y, z) to unit length by rsqrt and one Newton step; 0 stays 0
+static inline void normalize8(__m256& x, __m256& y, __m256& z) {
+    __m256 len2 = dot8(x, y, z, x, y, z);
+    __m256 r = _mm256_rsqrt_ps(len2);
+    __m256 half = _mm256_mul_ps(_mm256_set1_ps(0.5f), len2);
+    r = _mm256_mul_ps(r, _mm256_sub_ps(_mm256_set1_ps(1.5f), _mm256_mul_ps(half, _mm256_mul_ps(r, r))));
+    r = _mm256_and_ps(r, _mm256_cmp_ps(len2, _mm256_setzero_ps(), _CMP_GT_OQ));
+    x = _mm256_mul_ps(x, r);
+    y = _mm256_mul_ps(y, r);
+    z = _mm256_mul_ps(z, r);
+}
+#endif
+
+template <bool Normalize>
+void PBRKernel(const PBRInputs& in, const ColorOutputs& out, size_t count) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    __m256 pi = _mm256_set1_ps(float(PI)), invPi = _mm256_set1_ps(float(1.0 / PI));
+    for (; i + 8 <= count; i += 8) {
+        __m256 nx = _mm256_loadu_ps(in.nx + i), ny = _mm256_loadu_ps(in.ny + i), nz = _mm256_loadu_ps(in.nz + i);
+        __m256 vx = _mm256_loadu_ps(in.vx + i), vy = _mm256_loadu_ps(in.vy + i), vz = _mm256_loadu_ps(in.vz + i);
+        __m256 lx = _mm256_loadu_ps(in.lx + i), ly = _mm256_loadu_ps(in.ly + i), lz = _mm256_loadu_ps(in.lz + i);
+        if (Normalize) {
+            normalize8(nx, ny, nz);
+            normalize8(vx, vy, vz);
+            normalize8(lx, ly, lz);
+        }
+        __m256 hx = _mm256_add_ps(vx, lx), hy = _mm256_add_ps(vy, ly), hz = _mm256_add_ps(vz, lz);
+        normalize8(hx, hy, hz);
+
+        __m256 NdotV = _mm256_max_ps(dot8(nx, ny, nz, vx, vy, vz), zero);
+        __m256 NdotL = _mm256_max_ps(dot8(nx, ny, nz, lx, ly, lz), zero);
+        __m256 NdotH = dot8(nx, ny, nz, hx, hy, hz);
+        __m256 HdotV = _mm256_max_ps(dot8(hx, hy, hz, vx, vy, vz), zero);
+        __m256 cx = _mm256_sub_ps(_mm256_mul_ps(ny, hz), _mm256_mul_ps(nz, hy));
+        __m256 cy = _mm256_sub_ps(_mm256_mul_ps(nz, hx), _mm256_mul_ps(nx, hz));
+        __m256 cz = _mm256_sub_ps(_mm256_mul_ps(nx, hy), _mm256_mul_ps(ny, hx));
+
+        __m256 rough = _mm256_loadu_ps(in.roughness + i), metallic = _mm256_loadu_ps(in.metallic + i);
+        __m256 a = _mm256_mul_ps(rough, rough);
+        __m256 a2 = _mm256_mul_ps(a, a);
+        __m256 r1 = _mm256_add_ps(rough, one);
+        __m256 k = _mm256_mul_ps(_mm256_mul_ps(r1, r1), _mm256_set1_ps(0.125f));
+        __m256 d = madd(_mm256_mul_ps(NdotH, NdotH), a2, dot8(cx, cy, cz, cx, cy, cz));
+        d = _mm256_blendv_ps(one, d, _mm256_cmp_ps(NdotH, zero, _CMP_GT_OQ));
+        __m256 oneMinusK = _mm256_sub_ps(one, k);
+        __m256 qV = madd(NdotV, oneMinusK, k);
+        __m256 qL = madd(NdotL, oneMinusK, k);
+        __m256 VL = _mm256_mul_ps(NdotV, NdotL);
+        __m256 denom = _mm256_mul_ps(_mm256_mul_ps(pi, _mm256_mul_ps(d, d)),
+                                     _mm256_mul_ps(_mm256_mul_ps(qV, qL),
+                                                   madd(VL, _mm256_set1_ps(4.0f), _mm256_set1_ps(1e-5f))));
+        __m256 spec = _mm256_div_ps(_mm256_mul_ps(a2, VL), denom);
+
+        __m256 m = _mm256_sub_ps(one, HdotV);
+        __m256 m2 = _mm256_mul_ps(m, m);
+        __m256 w = _mm256_mul_ps(_mm256_mul_ps(m2, m2), m);
+        __m256 dielectric = _mm256_mul_ps(_mm256_set1_ps(0.04f), _mm256_sub_ps(one, metallic));
+        __m256 diffuseScale = _mm256_mul_ps(_mm256_sub_ps(one, metallic), invPi);
+
+        const float* albedo[3] = {in.albedoR + i, in.albedoG + i, in.albedoB + i};
+        float* dst[3] = {out.r + i, out.g + i, out.b + i};
+        for (int c = 0; c < 3; c++) {
+            __m256 alb = _mm256_loadu_ps(albedo[c]);
+            __m256 F0 = madd(alb, metallic, dielectric);
+            __m256 F = madd(_mm256_sub_ps(one, F0), w, F0);
+            __m256 diffuse = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(one, F), diffuseScale), alb);
+            _mm256_storeu_ps(dst[c], _mm256_mul_ps(madd(F, spec, diffuse), NdotL));
+        }
+    }
+#endif
+    for (; i < count; i++)
+        PBRSample<Normalize>(in, out, i);
+}
+
+void PBRBatch(const PBRInputs& in, const ColorOutputs& out, size_t count, bool unitVectors) {
+    if (unitVectors) PBRKernel<false>(in, out, count);
+    else PBRKernel<true>(in, out, count);
+}
+
+/* =======================
+   FAST PATH CHECKS
+   ======================= */
+struct Rng {
+    uint64_t state;
+
+    double next() {   // uniform in [0, 1)
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (state >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+Vec3 randomDir(Rng& rng) {
+    double z = 2.0 * rng.next() - 1.0;
+    double phi = 2.0 * PI * rng.next();
+    double s = sqrt(1.0 - z * z);
+    return {s * cos(phi), s * sin(phi), z};
+}
+
+struct ShadeSample {
+    Vec3 N, V, L, albedo;
+    double metallic, roughness;
+};
+
+double maxComponent(const Vec3& v) {
+    return max(fabs(v.x), max(fabs(v.y), fabs(v.z)));
+}
+
+// Compares both fast paths against their references and times PBR()
+// against PBRFast(); returns false if a documented bound is exceeded
+bool checkFastPath(const BRDFTables& t) {
+    const int COUNT = 1 << 20;
+    vector<ShadeSample> samples(COUNT);
+    Rng rng{12345};
+    for (ShadeSample& s : samples) {
+        s.N = randomDir(rng);
+        s.V = randomDir(rng);
+        s.L = randomDir(rng);
+        if (dot(s.N, s.V) < 0.0) s.V = -s.V;
+        s.albedo = {rng.next(), rng.next(), rng.next()};
+        s.metallic = rng.next();
+        s.roughness = 0.05 + 0.95 * rng.next();
+    }
+
+    double worstPBR = 0.0;
+    for (const ShadeSample& s : samples) {
+        Vec3 ref = PBR(s.N, s.V, s.L, s.albedo, s.metallic, s.roughness);
+        Vec3 fast = PBRFast(s.N, s.V, s.L, s.albedo, s.metallic, s.roughness);
+        worstPBR = max(worstPBR, maxComponent(fast - ref) / max(1.0, maxComponent(ref)));
+    }
+
+    // References integrated with 16x the table's sample count
+    double worstDFG = 0.0;
+    for (int i = 0; i < 1024; i++) {
+        double NdotV = rng.next();
+        double roughness = 0.05 + 0.95 * rng.next();
+        double F0 = rng.next();
+        double A, B;
+        integrateDFG(NdotV, roughness, 16 * DFG_SAMPLES, A, B);
+        Vec3 fast = ambientSpecular(t, NdotV, roughness, {F0, F0, F0}, {1, 1, 1});
+        worstDFG = max(worstDFG, fabs(fast.x - (F0 * A + B)));
+    }
+
+    Vec3 sink = {0, 0, 0};
+    auto t0 = chrono::steady_clock::now();
+    for (const ShadeSample& s : samples)
+        sink = sink + PBR(s.N, s.V, s.L, s.albedo, s.metallic, s.roughness);
+    auto t1 = chrono::steady_clock::now();
+    for (const ShadeSample& s : samples)
+        sink = sink + PBRFast(s.N, s.V, s.L, s.albedo, s.metallic, s.roughness);
+    auto t2 = chrono::steady_clock::now();
+
+    double refNs = chrono::duration<double, nano>(t1 - t0).count() / COUNT;
+    double fastNs = chrono::duration<double, nano>(t2 - t1).count() / COUNT;
+    bool ok = worstPBR <= 1e-12 && worstDFG <= 2.5e-3;
+
+    cout << "PBRFast max rel error = " << worstPBR
+         << ", DFG max abs error = " << worstDFG
+         << (ok ? " (within bounds)" : " (OUT OF BOUNDS)") << "\n";
+    cout << "PBR " << refNs << " ns, PBRFast " << fastNs
+         << " ns per sample (checksum " << sink.x + sink.y + sink.z << ")\n";
+    return ok;
+}
+
+// SoA streams for one batch, three per vector or color; unit* hold N, V
+// and L pre-normalized
+struct PBRBuffers {
+    vector<float> n[3], v[3], l[3], albedo[3], metallic, roughness;
+    vector<float> un[3], uv[3], ul[3], out[3];
+
+    explicit PBRBuffers(size_t count) : metallic(count), roughness(count) {
+        for (int c = 0; c < 3; c++)
+            for (vector<float>* s : {n, v, l, albedo, un, uv, ul, out})
+                s[c].resize(count);
+    }
+
+    PBRInputs inputs(bool unit) {
+        vector<float>* N = unit ? un : n;
+        vector<float>* V = unit ? uv : v;
+        vector<float>* L = unit ? ul : l;
+        return {N[0].data(), N[1].data(), N[2].data(),
+                V[0].data(), V[1].data(), V[2].data(),
+                L[0].data(), L[1].data(), L[2].data(),
+                albedo[0].data(), albedo[1].data(), albedo[2].data(),
+                metallic.data(), roughness.data()};
+    }
+
+    Vec3 at(const vector<float>* s, size_t i) const { return {s[0][i], s[1][i], s[2][i]}; }
+};
+
+void storeVec(vector<float>* s, size_t i, const Vec3& d) {
+    s[0][i] = float(d.x);
+    s[1][i] = float(d.y);
+    s[2][i] = float(d.z);
+}
+
+// Compares PBRBatch() in both modes against PBR() and times all three;
+// returns false if the documented tolerance is exceeded
+bool checkBatch() {
+    const size_t COUNT = (1 << 20) + 5;   // odd size exercises the scalar tail
+    PBRBuffers buf(COUNT);
+    Rng rng{2024};
+    for (size_t i = 0; i < COUNT; i++) {
+        double scale = 0.5 + 2.0 * rng.next();
+        Vec3 N = randomDir(rng), V = randomDir(rng), L = randomDir(rng);
+        if (dot(N, V) < 0.0) V = -V;
+        storeVec(buf.n, i, N * scale);
+        storeVec(buf.v, i, V * (scale * 0.7));
+        storeVec(buf.l, i, L * (scale * 1.3));
+        // Unit streams are renormalized after rounding to float, as a G-buffer would be
+        storeVec(buf.un, i, normalize(buf.at(buf.n, i)));
+        storeVec(buf.uv, i, normalize(buf.at(buf.v, i)));
+        storeVec(buf.ul, i, normalize(buf.at(buf.l, i)));
+        storeVec(buf.albedo, i, {rng.next(), rng.next(), rng.next()});
+        buf.metallic[i] = float(rng.next());
+        buf.roughness[i] = float(0.05 + 0.95 * rng.next());
+    }
+
+    Vec3 sink = {0, 0, 0};
+    vector<Vec3> ref(COUNT);
+    auto t0 = chrono::steady_clock::now();
+    for (size_t i = 0; i < COUNT; i++) {
+        ref[i] = PBR(buf.at(buf.n, i), buf.at(buf.v, i), buf.at(buf.l, i),
+                     buf.at(buf.albedo, i), buf.metallic[i], buf.roughness[i]);
+        sink = sink + ref[i];
+    }
+    auto t1 = chrono::steady_clock::now();
+
+    double worst = 0.0, seconds[2];
+    ColorOutputs out = {buf.out[0].data(), buf.out[1].data(), buf.out[2].data()};
+    for (int unitMode = 0; unitMode < 2; unitMode++) {
+        auto b0 = chrono::steady_clock::now();
+        PBRBatch(buf.inputs(unitMode == 1), out, COUNT, unitMode == 1);
+        seconds[unitMode] = chrono::duration<double>(chrono::steady_clock::now() - b0).count();
+        for (size_t i = 0; i < COUNT; i++) {
+            Vec3 diff = Vec3{out.r[i], out.g[i], out.b[i]} - ref[i];
+            worst = max(worst, maxComponent(diff) / max(1.0, maxComponent(ref[i])));
+        }
+    }
+
+    double scalarNs = chrono::duration<double, nano>(t1 - t0).count() / COUNT;
+    bool ok = worst <= 1e-4;
+    cout << "PBRBatch max rel error = " << worst
+         << (ok ? " (within tolerance)" : " (OUT OF TOLERANCE)") << "\n";
+    cout << "PBR " << scalarNs << " ns, batch " << seconds[0] * 1e9 / COUNT
+         << " ns, batch (unit vectors) " << seconds[1] * 1e9 / COUNT
+         << " ns per sample (checksum " << sink.x + sink.y + sink.z << ")\n";
+    return ok;
+}
+
 /* =======================
    MAIN
    ======================= */
@@ -146,4 +659,17 @@ int main() {
          << color.x << ", "
          << color.y << ", "
          << color.z << ")\n";
+
+    BRDFTables tables;
+    buildBRDFTables(tables);
+
+    Vec3 fast = PBRFast(N, V, L, albedo, metallic, roughness);
+    cout << "PBRFast color = ("
+         << fast.x << ", "
+         << fast.y << ", "
+         << fast.z << ")\n";
+
+    bool ok = checkFastPath(tables);
+    ok &= checkBatch();
+    return ok ? 0 : 1;
 }